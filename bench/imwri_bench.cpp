@@ -0,0 +1,471 @@
+/*
+* Copyright (c) 2014-2019 Fredrik Mellbin
+*
+* This file is part of VapourSynth.
+*
+* VapourSynth is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* VapourSynth is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with VapourSynth; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+// Measures the planar <-> pixel cache conversion paths on synthetic frames and full encode/decode
+// round trips through ImageMagick. All results are reported in megapixels per second.
+//
+// Before measuring anything the vectorized and bulk conversion paths in both directions are checked
+// against the scalar fallback and the run fails if their output isn't bit-identical. When built with
+// zlib the output of IMWRI's own PNG encoder is also decoded by ImageMagick and has to match the source
+// exactly. Pass --verify to only run these checks, which is what the conversion test does.
+//
+// Usage: imwri-bench [--verify] [width height]
+
+#include "conversion.h"
+#if defined(IMWRI_HAS_ZLIB)
+#include "pngencoder.h"
+#endif
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+// A planar frame laid out the way VapourSynth does it with rows aligned to 64 bytes, unless
+// padding is given in which case rows are that many samples longer than the width
+struct SyntheticFrame {
+    int width;
+    int height;
+    int bitsPerSample;
+    int bytesPerSample;
+    bool isFloat;
+    bool isGray;
+    bool hasAlpha;
+    ptrdiff_t stride;
+    std::vector<std::vector<uint8_t>> planes;
+
+    SyntheticFrame(int width, int height, int bitsPerSample, bool isFloat, bool isGray, bool hasAlpha, int padding = 0) :
+        width(width), height(height), bitsPerSample(bitsPerSample), bytesPerSample(bitsPerSample > 16 ? 4 : (bitsPerSample > 8 ? 2 : 1)),
+        isFloat(isFloat), isGray(isGray), hasAlpha(hasAlpha) {
+        if (padding)
+            stride = (width + padding) * bytesPerSample;
+        else
+            stride = (width * bytesPerSample + 63) & ~63;
+        planes.resize((isGray ? 1 : 3) + (hasAlpha ? 1 : 0));
+
+        // a gradient with some noise so codecs have something resembling real content to work with
+        uint32_t seed = 12345;
+        for (auto &plane : planes) {
+            plane.resize(stride * height);
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    seed = seed * 1664525 + 1013904223;
+                    double v = (x + y) / static_cast<double>(width + height) * 0.9 + (seed >> 8) / static_cast<double>(1 << 24) * 0.1;
+                    uint8_t *p = plane.data() + y * stride + x * bytesPerSample;
+                    if (isFloat) {
+                        float f = static_cast<float>(v);
+                        memcpy(p, &f, 4);
+                    } else {
+                        uint32_t i = static_cast<uint32_t>(v * ((1ULL << bitsPerSample) - 1));
+                        memcpy(p, &i, bytesPerSample);
+                    }
+                }
+            }
+        }
+    }
+
+    ConstPlanes constPlanes() const {
+        ConstPlanes p = {};
+        for (int i = 0; i < 3; i++) {
+            p.ptr[i] = planes[isGray ? 0 : i].data();
+            p.stride[i] = stride;
+        }
+        if (hasAlpha) {
+            p.ptr[3] = planes.back().data();
+            p.stride[3] = stride;
+        }
+        return p;
+    }
+
+    Planes writablePlanes() {
+        Planes p = {};
+        for (int i = 0; i < 3; i++) {
+            p.ptr[i] = planes[isGray ? 0 : i].data();
+            p.stride[i] = stride;
+        }
+        if (hasAlpha) {
+            p.ptr[3] = planes.back().data();
+            p.stride[3] = stride;
+        }
+        return p;
+    }
+
+    std::string name() const {
+        std::string s = isGray ? "Gray" : "RGB";
+        if (hasAlpha)
+            s += "A";
+        s += std::to_string(bitsPerSample);
+        if (isFloat)
+            s += "f";
+        return s;
+    }
+};
+
+// Same setup as frameToImage() in imwri.cpp
+static Magick::Image createImage(const SyntheticFrame &frame, const std::string &format) {
+    Magick::Image image(Magick::Geometry(frame.width, frame.height), Magick::Color(0, 0, 0, 0));
+    image.magick(format);
+    image.modulusDepth(frame.bitsPerSample);
+    image.alphaChannel(frame.hasAlpha ? Magick::ActivateAlphaChannel : Magick::RemoveAlphaChannel);
+    if (frame.isGray)
+        image.colorSpace(Magick::GRAYColorspace);
+    if (frame.isFloat)
+        image.attribute("quantum:format", "floating-point");
+    return image;
+}
+
+// runs func repeatedly for at least a quarter of a second and returns the average time per call in seconds
+template<typename F>
+static double measure(F func) {
+    func(); // warm up caches and lazily initialized state
+    int iterations = 0;
+    auto start = Clock::now();
+    std::chrono::duration<double> elapsed;
+    do {
+        func();
+        iterations++;
+        elapsed = Clock::now() - start;
+    } while (elapsed.count() < 0.25);
+    return elapsed.count() / iterations;
+}
+
+static void report(const std::string &name, int width, int height, double seconds) {
+    printf("%-40s %10.1f MPix/s\n", name.c_str(), width * static_cast<double>(height) / seconds / 1e6);
+}
+
+// Compares the visible samples of two frames with the same layout, the padding is ignored
+static bool samePlanes(const SyntheticFrame &a, const SyntheticFrame &b, int &mismatchPlane, int &mismatchRow, int &mismatchX) {
+    size_t rowSize = static_cast<size_t>(a.width) * a.bytesPerSample;
+    for (size_t plane = 0; plane < a.planes.size(); plane++) {
+        for (int y = 0; y < a.height; y++) {
+            const uint8_t *pa = a.planes[plane].data() + y * a.stride;
+            const uint8_t *pb = b.planes[plane].data() + y * b.stride;
+            if (memcmp(pa, pb, rowSize)) {
+                size_t i = 0;
+                while (pa[i] == pb[i])
+                    i++;
+                mismatchPlane = static_cast<int>(plane);
+                mismatchRow = y;
+                mismatchX = static_cast<int>(i / a.bytesPerSample);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Returns the number of layouts where the vectorized or bulk import and export paths and the scalar paths disagree
+static int verifySIMD() {
+    const int widths[] = { 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 47, 63, 64, 65, 1925 };
+    const int paddings[] = { 0, 1, 3, 13 };
+    int failures = 0;
+    int checked = 0;
+
+    for (int bits = 8; bits <= 32; bits++) {
+        if (bits > 16 && bits < 32)
+            continue;
+        for (int isFloat = 0; isFloat <= (bits == 32 ? 1 : 0); isFloat++) {
+            for (int isGray = 0; isGray <= 1; isGray++) {
+                for (int hasAlpha = 0; hasAlpha <= 1; hasAlpha++) {
+                    for (int width : widths) {
+                        for (int padding : paddings) {
+                            SyntheticFrame frame(width, 3, bits, !!isFloat, !!isGray, !!hasAlpha, padding);
+                            Magick::Image simd = createImage(frame, "MIFF");
+                            Magick::Image scalar = createImage(frame, "MIFF");
+                            planesToImage(frame.constPlanes(), simd, frame.width, frame.height, frame.bitsPerSample, frame.bytesPerSample, frame.isFloat, true);
+                            planesToImage(frame.constPlanes(), scalar, frame.width, frame.height, frame.bitsPerSample, frame.bytesPerSample, frame.isFloat, false);
+                            checked++;
+
+                            size_t channels = simd.channels();
+                            Magick::Pixels simdCache(simd);
+                            Magick::Pixels scalarCache(scalar);
+                            bool same = true;
+                            for (int y = 0; y < frame.height && same; y++) {
+                                const Magick::Quantum *a = simdCache.getConst(0, y, width, 1);
+                                const Magick::Quantum *b = scalarCache.getConst(0, y, width, 1);
+                                size_t i = 0;
+                                while (i < width * channels && a[i] == b[i])
+                                    i++;
+                                if (i < width * channels) {
+                                    printf("MISMATCH write %s width=%d padding=%d: row %d pixel %d channel %d is %.17g but should be %.17g\n",
+                                        frame.name().c_str(), width, padding, y, static_cast<int>(i / channels), static_cast<int>(i % channels),
+                                        static_cast<double>(a[i]), static_cast<double>(b[i]));
+                                    same = false;
+                                }
+                            }
+                            if (!same) {
+                                failures++;
+                                continue;
+                            }
+
+                            // the read side starts from the same image, the outputs start out as copies of the
+                            // input so that padding never differs
+                            SyntheticFrame bulkOut(frame);
+                            SyntheticFrame scalarOut(frame);
+                            imageToPlanes(scalar, bulkOut.writablePlanes(), frame.width, frame.height, frame.bitsPerSample, frame.bytesPerSample, frame.isFloat, true);
+                            imageToPlanes(scalar, scalarOut.writablePlanes(), frame.width, frame.height, frame.bitsPerSample, frame.bytesPerSample, frame.isFloat, false);
+                            checked++;
+                            int plane, row, x;
+                            if (!samePlanes(bulkOut, scalarOut, plane, row, x)) {
+                                printf("MISMATCH read %s width=%d padding=%d: plane %d row %d pixel %d differs\n",
+                                    frame.name().c_str(), width, padding, plane, row, x);
+                                failures++;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%-40s %d of %d layouts identical\n", "SIMD and bulk vs scalar conversion", checked - failures, checked);
+    return failures;
+}
+
+#if defined(IMWRI_HAS_ZLIB)
+// Collects the PNG encoder's output
+struct ByteBuffer {
+    std::vector<unsigned char> data;
+
+    void clear() {
+        data.clear();
+    }
+
+    void write(const void *src, size_t size) {
+        const unsigned char *p = static_cast<const unsigned char *>(src);
+        data.insert(data.end(), p, p + size);
+    }
+};
+
+// Returns the number of encodes that ImageMagick doesn't decode back to the source. With more than one thread
+// the rows are split into chunks that are deflated separately and joined, the heights are picked so that the
+// last chunk is a partial one for every layout.
+static int verifyPNG() {
+    bool readable = false;
+    try {
+        readable = Magick::CoderInfo("PNG").isReadable();
+    } catch (Magick::Exception &) {
+    }
+    if (!readable) {
+        printf("%-40s skipped, ImageMagick can't read PNG\n", "native PNG encoder round trip");
+        return 0;
+    }
+
+    const int sizes[][2] = { { 1, 1 }, { 7, 3 }, { 201, 2000 } };
+    const int threadCounts[] = { 1, 4 };
+    int failures = 0;
+    int checked = 0;
+
+    for (int bits = 8; bits <= 16; bits += 8) {
+        // the pixel cache of a Q8 build can't hold 16 bit samples losslessly
+        if (bits > MAGICKCORE_QUANTUM_DEPTH)
+            continue;
+        for (int isGray = 0; isGray <= 1; isGray++) {
+            for (int hasAlpha = 0; hasAlpha <= 1; hasAlpha++) {
+                for (const auto &size : sizes) {
+                    SyntheticFrame frame(size[0], size[1], bits, false, !!isGray, !!hasAlpha);
+                    for (int filter = 0; filter <= 5; filter++) {
+                        for (int level : { 0, 1, 6, 9 }) {
+                            // every level only with adaptive filtering, the fixed filters are checked at the default level
+                            if (filter < 5 && level != 6)
+                                continue;
+                            for (int threads : threadCounts) {
+                                PNGParallelFor parallel = [threads](int count, const std::function<void(int)> &func) {
+                                    std::atomic<int> next(0);
+                                    std::vector<std::thread> workers;
+                                    for (int i = 0; i < std::min(threads, count); i++)
+                                        workers.emplace_back([&]() {
+                                            for (int n = next++; n < count; n = next++)
+                                                func(n);
+                                        });
+                                    for (auto &worker : workers)
+                                        worker.join();
+                                };
+                                ByteBuffer buf;
+                                encodePNGPlanes(frame.constPlanes(), frame.width, frame.height, frame.bytesPerSample, frame.isGray, level, filter, threads, parallel, buf);
+                                checked++;
+
+                                std::string layout = frame.name() + " " + std::to_string(frame.width) + "x" + std::to_string(frame.height) +
+                                    " filter=" + std::to_string(filter) + " level=" + std::to_string(level) + " threads=" + std::to_string(threads);
+                                SyntheticFrame out(frame);
+                                try {
+                                    Magick::Image decoded(Magick::Blob(buf.data.data(), buf.data.size()));
+                                    if (static_cast<int>(decoded.columns()) != frame.width || static_cast<int>(decoded.rows()) != frame.height) {
+                                        printf("MISMATCH png %s: decoded as %dx%d\n", layout.c_str(), static_cast<int>(decoded.columns()), static_cast<int>(decoded.rows()));
+                                        failures++;
+                                        continue;
+                                    }
+                                    // start from zeroes so that a missing plane shows up as a difference
+                                    for (auto &plane : out.planes)
+                                        std::fill(plane.begin(), plane.end(), 0);
+                                    imageToPlanes(decoded, out.writablePlanes(), frame.width, frame.height, frame.bitsPerSample, frame.bytesPerSample, false);
+                                } catch (Magick::Exception &e) {
+                                    printf("MISMATCH png %s: %s\n", layout.c_str(), e.what());
+                                    failures++;
+                                    continue;
+                                }
+                                int plane, row, x;
+                                if (!samePlanes(out, frame, plane, row, x)) {
+                                    printf("MISMATCH png %s: plane %d row %d pixel %d differs\n", layout.c_str(), plane, row, x);
+                                    failures++;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%-40s %d of %d encodes identical\n", "native PNG encoder round trip", checked - failures, checked);
+    return failures;
+}
+#else
+static int verifyPNG() {
+    return 0;
+}
+#endif
+
+static void benchConversion(const SyntheticFrame &frame) {
+    Magick::Image image = createImage(frame, "MIFF");
+    ConstPlanes src = frame.constPlanes();
+    report("write " + frame.name(), frame.width, frame.height, measure([&]() {
+        planesToImage(src, image, frame.width, frame.height, frame.bitsPerSample, frame.bytesPerSample, frame.isFloat);
+    }));
+
+    SyntheticFrame out(frame);
+    Planes dst = out.writablePlanes();
+    report("read " + frame.name(), frame.width, frame.height, measure([&]() {
+        imageToPlanes(image, dst, frame.width, frame.height, frame.bitsPerSample, frame.bytesPerSample, frame.isFloat);
+    }));
+}
+
+static void benchDither(const SyntheticFrame &frame, int depth, DitherType type, const std::string &typeName) {
+    DitherMatrix matrix(type, frame.isFloat ? 0 : frame.bitsPerSample - depth);
+    SyntheticFrame out(frame.width, frame.height, depth, false, frame.isGray, frame.hasAlpha);
+    report("dither " + frame.name() + " to " + std::to_string(depth) + " " + typeName, frame.width, frame.height, measure([&]() {
+        for (size_t i = 0; i < frame.planes.size(); i++) {
+            uint8_t *dst = out.planes[i].data();
+            if (frame.isFloat)
+                ditherRowsFloat(reinterpret_cast<const float *>(frame.planes[i].data()), frame.stride, dst, out.stride, frame.width, 0, frame.height, depth, matrix);
+            else
+                ditherRows(reinterpret_cast<const uint16_t *>(frame.planes[i].data()), frame.stride, dst, out.stride, frame.width, 0, frame.height, frame.bitsPerSample - depth, depth, matrix);
+        }
+    }));
+}
+
+static void benchRoundTrip(const std::string &format, const SyntheticFrame &frame) {
+    Magick::Image image = createImage(frame, format);
+    planesToImage(frame.constPlanes(), image, frame.width, frame.height, frame.bitsPerSample, frame.bytesPerSample, frame.isFloat);
+    image.strip();
+
+    Magick::Blob blob;
+    report("encode " + format + " " + frame.name(), frame.width, frame.height, measure([&]() {
+        Magick::Image copy(image);
+        copy.write(&blob);
+    }));
+
+    SyntheticFrame out(frame);
+    Planes dst = out.writablePlanes();
+    report("decode " + format + " " + frame.name(), frame.width, frame.height, measure([&]() {
+        Magick::Image decoded(blob);
+        imageToPlanes(decoded, dst, frame.width, frame.height, frame.bitsPerSample, frame.bytesPerSample, frame.isFloat);
+    }));
+}
+
+// The first image of each format pays for loading and registering its coder, which is a large part of the
+// startup cost of short jobs, so it's timed separately before anything else uses the coder
+static void benchFirstUse(const std::string &format) {
+    SyntheticFrame frame(16, 16, 8, false, false, false);
+    auto start = Clock::now();
+    Magick::Image image = createImage(frame, format);
+    planesToImage(frame.constPlanes(), image, frame.width, frame.height, frame.bitsPerSample, frame.bytesPerSample, frame.isFloat);
+    Magick::Blob blob;
+    image.write(&blob);
+    Magick::Image decoded(blob);
+    printf("%-40s %10.2f ms\n", ("first use " + format).c_str(), std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+}
+
+int main(int argc, char **argv) {
+    int width = 1920;
+    int height = 1080;
+    bool verifyOnly = false;
+    int arg = 1;
+    if (arg < argc && std::string(argv[arg]) == "--verify") {
+        verifyOnly = true;
+        arg++;
+    }
+    if (argc - arg == 2) {
+        width = atoi(argv[arg]);
+        height = atoi(argv[arg + 1]);
+    } else if (argc != arg) {
+        width = 0;
+    }
+    if (width <= 0 || height <= 0) {
+        fprintf(stderr, "Usage: %s [--verify] [width height]\n", argv[0]);
+        return 1;
+    }
+
+    auto start = Clock::now();
+    Magick::InitializeMagick(*argv);
+    printf("%-40s %10.2f ms\n", "ImageMagick initialization", std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+
+    try {
+        // the conversion check doesn't need any coders, the PNG check is skipped when ImageMagick can't read PNG
+        if (verifyOnly)
+            return (verifySIMD() + verifyPNG()) ? 1 : 0;
+
+        const char *formats[] = { "PNG", "TIFF", "JPEG", "EXR", "DPX" };
+        for (const char *format : formats)
+            benchFirstUse(format);
+
+        if (verifySIMD() + verifyPNG())
+            return 1;
+
+        const int depths[] = { 8, 10, 12, 16, 32 };
+        for (int bits : depths)
+            for (int isFloat = 0; isFloat <= (bits == 32 ? 1 : 0); isFloat++)
+                for (int isGray = 0; isGray <= 1; isGray++)
+                    for (int hasAlpha = 0; hasAlpha <= 1; hasAlpha++)
+                        benchConversion(SyntheticFrame(width, height, bits, !!isFloat, !!isGray, !!hasAlpha));
+
+        benchDither(SyntheticFrame(width, height, 10, false, false, false), 8, ditherOrdered, "ordered");
+        benchDither(SyntheticFrame(width, height, 16, false, false, false), 8, ditherBlueNoise, "blue noise");
+        benchDither(SyntheticFrame(width, height, 32, true, false, false), 8, ditherBlueNoise, "blue noise");
+
+        benchRoundTrip("PNG", SyntheticFrame(width, height, 8, false, false, false));
+        benchRoundTrip("PNG", SyntheticFrame(width, height, 16, false, false, true));
+        benchRoundTrip("TIFF", SyntheticFrame(width, height, 16, false, false, false));
+        benchRoundTrip("TIFF", SyntheticFrame(width, height, 32, true, false, false));
+        benchRoundTrip("JPEG", SyntheticFrame(width, height, 8, false, false, false));
+        benchRoundTrip("EXR", SyntheticFrame(width, height, 32, true, false, true));
+        benchRoundTrip("DPX", SyntheticFrame(width, height, 10, false, false, false));
+    } catch (Magick::Exception &e) {
+        fprintf(stderr, "ImageMagick error: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
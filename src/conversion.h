@@ -0,0 +1,914 @@
+/*
+* Copyright (c) 2014-2019 Fredrik Mellbin
+*
+* This file is part of VapourSynth.
+*
+* VapourSynth is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* VapourSynth is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with VapourSynth; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+// Conversion between planar sample data and ImageMagick's interleaved pixel cache. Kept free of any
+// VapourSynth API usage so it can also be used by the benchmark.
+
+#ifndef IMWRI_CONVERSION_H
+#define IMWRI_CONVERSION_H
+
+#include <Magick++.h>
+#include <VSHelper4.h>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+// QuantumRange expands to a cast to an unqualified Quantum without HDRI
+using MagickCore::Quantum;
+
+// Plane pointers in R, G, B, A order. For gray the first three all point to the same plane and
+// the alpha plane is null when there is none.
+struct ConstPlanes {
+    const void *ptr[4];
+    ptrdiff_t stride[4];
+};
+
+struct Planes {
+    void *ptr[4];
+    ptrdiff_t stride[4];
+};
+
+#if defined(__SSE2__) || (defined(_MSC_VER) && !defined(__clang__) && ((defined(_M_IX86_FP) && _M_IX86_FP == 2) || defined(_M_X64)))
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+
+static inline void ssePackPair8(__m128i &outLo, __m128i &outHi, __m128i a, __m128i b) {
+    outLo = _mm_packus_epi16(
+        _mm_and_si128(a, _mm_set1_epi16(0xff)),
+        _mm_and_si128(b, _mm_set1_epi16(0xff))
+    );
+    outHi = _mm_packus_epi16(
+        _mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)
+    );
+}
+static inline void ssePackPair16(__m128i &outLo, __m128i &outHi, __m128i a, __m128i b) {
+    // swap middle two 16-bit words in every 64-bit block
+    a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a, _MM_SHUFFLE(3,1,2,0)), _MM_SHUFFLE(3,1,2,0));
+    b = _mm_shufflehi_epi16(_mm_shufflelo_epi16(b, _MM_SHUFFLE(3,1,2,0)), _MM_SHUFFLE(3,1,2,0));
+
+    // pull alternating 32-bit blocks
+    outLo = _mm_castps_si128(_mm_shuffle_ps(
+        _mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2,0,2,0)
+    ));
+    outHi = _mm_castps_si128(_mm_shuffle_ps(
+        _mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3,1,3,1)
+    ));
+}
+
+template <std::size_t N>
+static inline void sseWritePixels8(void *dst, const __m128i (&vecs)[N]) {
+#ifdef MAGICKCORE_HDRI_SUPPORT
+    // pixels are always 32-bit float
+    float *p = reinterpret_cast<float*>(dst);
+    for (__m128i vec : vecs) {
+        __m128i vec0, vec1;
+        if (MAGICKCORE_QUANTUM_DEPTH == 8) {
+            vec0 = _mm_unpacklo_epi8(vec, _mm_setzero_si128());
+            vec1 = _mm_unpackhi_epi8(vec, _mm_setzero_si128());
+        } else {
+            vec0 = _mm_unpacklo_epi8(vec, vec);
+            vec1 = _mm_unpackhi_epi8(vec, vec);
+        }
+
+        __m128 vec00 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(vec0, _mm_setzero_si128()));
+        __m128 vec01 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(vec0, _mm_setzero_si128()));
+        __m128 vec10 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(vec1, _mm_setzero_si128()));
+        __m128 vec11 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(vec1, _mm_setzero_si128()));
+        if (MAGICKCORE_QUANTUM_DEPTH == 32) {
+            vec00 = _mm_mul_ps(vec00, _mm_set1_ps(65537.0));
+            vec01 = _mm_mul_ps(vec01, _mm_set1_ps(65537.0));
+            vec10 = _mm_mul_ps(vec10, _mm_set1_ps(65537.0));
+            vec11 = _mm_mul_ps(vec11, _mm_set1_ps(65537.0));
+        }
+        _mm_storeu_ps(p, vec00);
+        _mm_storeu_ps(p + 4, vec01);
+        _mm_storeu_ps(p + 8, vec10);
+        _mm_storeu_ps(p +12, vec11);
+        p += 16;
+    }
+#else
+    __m128i *p = reinterpret_cast<__m128i*>(dst);
+    if (sizeof(MagickCore::Quantum) == 1) {
+        for (__m128i vec : vecs)
+            _mm_storeu_si128(p++, vec);
+    } else {
+        for (__m128i vec : vecs) {
+            __m128i vec0, vec1;
+            if (MAGICKCORE_QUANTUM_DEPTH == 8) {
+                vec0 = _mm_unpacklo_epi8(vec, _mm_setzero_si128());
+                vec1 = _mm_unpackhi_epi8(vec, _mm_setzero_si128());
+            } else {
+                vec0 = _mm_unpacklo_epi8(vec, vec);
+                vec1 = _mm_unpackhi_epi8(vec, vec);
+            }
+            if (sizeof(MagickCore::Quantum) == 4) {
+                if (MAGICKCORE_QUANTUM_DEPTH == 32) {
+                    _mm_storeu_si128(p++, _mm_unpacklo_epi16(vec0, vec0));
+                    _mm_storeu_si128(p++, _mm_unpackhi_epi16(vec0, vec0));
+                    _mm_storeu_si128(p++, _mm_unpacklo_epi16(vec1, vec1));
+                    _mm_storeu_si128(p++, _mm_unpackhi_epi16(vec1, vec1));
+                } else { // 8 or 16
+                    _mm_storeu_si128(p++, _mm_unpacklo_epi16(vec0, _mm_setzero_si128()));
+                    _mm_storeu_si128(p++, _mm_unpackhi_epi16(vec0, _mm_setzero_si128()));
+                    _mm_storeu_si128(p++, _mm_unpacklo_epi16(vec1, _mm_setzero_si128()));
+                    _mm_storeu_si128(p++, _mm_unpackhi_epi16(vec1, _mm_setzero_si128()));
+                }
+            } else { // sizeof(MagickCore::Quantum) == 2
+                _mm_storeu_si128(p++, vec0);
+                _mm_storeu_si128(p++, vec1);
+            }
+        }
+    }
+#endif
+}
+template <std::size_t N>
+static inline void sseWritePixels16(void *dst, const __m128i (&vecs)[N]) {
+#ifdef MAGICKCORE_HDRI_SUPPORT
+    // pixels are always 32-bit float (64-bit float unsupported here)
+    float *p = reinterpret_cast<float*>(dst);
+    for (__m128i vec : vecs) {
+        if (MAGICKCORE_QUANTUM_DEPTH == 8)
+            vec = _mm_srli_epi16(vec, 8);
+
+        __m128 vec0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(vec, _mm_setzero_si128()));
+        __m128 vec1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(vec, _mm_setzero_si128()));
+        if (MAGICKCORE_QUANTUM_DEPTH == 32) {
+            vec0 = _mm_mul_ps(vec0, _mm_set1_ps(65537.0));
+            vec1 = _mm_mul_ps(vec1, _mm_set1_ps(65537.0));
+        }
+        _mm_storeu_ps(p, vec0);
+        _mm_storeu_ps(p + 4, vec1);
+        p += 8;
+    }
+#else
+    __m128i *p = reinterpret_cast<__m128i*>(dst);
+    if (sizeof(MagickCore::Quantum) == 1) {
+        for (std::size_t i = 0; i < N; i += 2) {
+            __m128i vec0 = vecs[i], vec1 = vecs[i + 1];
+            vec0 = _mm_srli_epi16(vec0, 8); // should rounding be done here?
+            vec1 = _mm_srli_epi16(vec1, 8);
+            _mm_storeu_si128(p++, _mm_packus_epi16(vec0, vec1));
+        }
+    } else {
+        for (__m128i vec : vecs) {
+            if (sizeof(MagickCore::Quantum) == 4) {
+                if (MAGICKCORE_QUANTUM_DEPTH == 32) {
+                    _mm_storeu_si128(p++, _mm_unpacklo_epi16(vec, vec));
+                    _mm_storeu_si128(p++, _mm_unpackhi_epi16(vec, vec));
+                } else { // 8 or 16
+                    if (MAGICKCORE_QUANTUM_DEPTH == 8)
+                        vec = _mm_srli_epi16(vec, 8);
+                    _mm_storeu_si128(p++, _mm_unpacklo_epi16(vec, _mm_setzero_si128()));
+                    _mm_storeu_si128(p++, _mm_unpackhi_epi16(vec, _mm_setzero_si128()));
+                }
+            } else { // sizeof(MagickCore::Quantum) == 2
+                if (MAGICKCORE_QUANTUM_DEPTH == 8)
+                    vec = _mm_srli_epi16(vec, 8);
+                _mm_storeu_si128(p++, vec);
+            }
+        }
+    }
+#endif
+}
+#endif
+
+// Storage types that ImportImagePixels and ExportImagePixels scale the quantum range to
+template<typename T>
+struct PixelStorage;
+
+template<>
+struct PixelStorage<uint8_t> { static constexpr MagickCore::StorageType type = MagickCore::CharPixel; };
+
+template<>
+struct PixelStorage<uint16_t> { static constexpr MagickCore::StorageType type = MagickCore::ShortPixel; };
+
+template<>
+struct PixelStorage<uint32_t> { static constexpr MagickCore::StorageType type = MagickCore::LongPixel; };
+
+static const char *const planeChannelMaps[] = { "R", "G", "B", "A" };
+
+static void throwTransferException(MagickCore::ExceptionInfo *exception) {
+    try {
+        Magick::throwException(exception);
+    } catch (Magick::Exception &) {
+        MagickCore::DestroyExceptionInfo(exception);
+        throw;
+    }
+    MagickCore::DestroyExceptionInfo(exception);
+}
+
+// Pixel cache offset of a channel, -1 if the image doesn't have it. Same as Magick::Pixels::offset() but
+// without creating a view that holds a reference to the image.
+static ssize_t channelOffset(const Magick::Image &image, MagickCore::PixelChannel channel) {
+    const MagickCore::Image *img = image.constImage();
+    if (img->channel_map[channel].traits == MagickCore::UndefinedPixelTrait)
+        return -1;
+    return img->channel_map[channel].offset;
+}
+
+// True when ImageMagick's import and export loops scale samples of type T exactly like the scalar loops below,
+// which is the case for 8 and 16-bit samples that fill their type in Q8 and Q16 builds. 32-bit integers are
+// rounded instead of shifted and float goes through double precision, so those always use the scalar loops.
+template<typename T>
+static constexpr bool isExactTransfer(int bitsPerSample) {
+    return bitsPerSample == static_cast<int>(sizeof(T) * 8) &&
+        ((sizeof(T) == 1 && MAGICKCORE_QUANTUM_DEPTH <= 16) || (sizeof(T) == 2 && MAGICKCORE_QUANTUM_DEPTH == 16));
+}
+
+// Moves each plane into its channel with ImageMagick's own import loops, which handle any pixel cache
+// layout. Only usable when the samples fill the whole type since that is the range ImageMagick scales from.
+// Must not be called while a Magick::Pixels view of the image exists, the extra reference would make
+// modifyImage() copy the image and ImportImagePixels() then copy the whole pixel cache.
+template<typename T>
+static void importPlanes(const ConstPlanes &src, Magick::Image &image, int width, int height) {
+    // red, green and blue are all the same channel in a gray image
+    bool isGray = image.colorSpace() == Magick::GRAYColorspace;
+    image.modifyImage();
+    MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
+
+    bool success = true;
+    for (int plane = 0; plane < 4 && success; plane++) {
+        if (!src.ptr[plane] || (isGray && plane > 0 && plane < 3))
+            continue;
+        const uint8_t *ptr = static_cast<const uint8_t *>(src.ptr[plane]);
+        if (src.stride[plane] == static_cast<ptrdiff_t>(width * sizeof(T))) {
+            success = MagickCore::ImportImagePixels(image.image(), 0, 0, width, height, planeChannelMaps[plane], PixelStorage<T>::type, ptr, exception) == MagickCore::MagickTrue;
+        } else {
+            for (int y = 0; y < height && success; y++)
+                success = MagickCore::ImportImagePixels(image.image(), 0, y, width, 1, planeChannelMaps[plane], PixelStorage<T>::type, ptr + y * src.stride[plane], exception) == MagickCore::MagickTrue;
+        }
+    }
+
+    throwTransferException(exception);
+}
+
+// The counterpart of importPlanes. Planes are filled from alpha to red, skipping ones already written, so
+// a gray destination gets the blue channel just like the scalar path leaves it.
+template<typename T>
+static void exportPlanes(const Planes &dst, Magick::Image &image, int width, int height) {
+    MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
+
+    bool success = true;
+    for (int plane = 3; plane >= 0 && success; plane--) {
+        bool written = false;
+        for (int other = plane + 1; other < 4; other++)
+            written = written || dst.ptr[other] == dst.ptr[plane];
+        if (!dst.ptr[plane] || written)
+            continue;
+        if (plane == 3 && !image.alpha()) {
+            memset(dst.ptr[3], 0, dst.stride[3] * height);
+            continue;
+        }
+        uint8_t *ptr = static_cast<uint8_t *>(dst.ptr[plane]);
+        if (dst.stride[plane] == static_cast<ptrdiff_t>(width * sizeof(T))) {
+            success = MagickCore::ExportImagePixels(image.constImage(), 0, 0, width, height, planeChannelMaps[plane], PixelStorage<T>::type, ptr, exception) == MagickCore::MagickTrue;
+        } else {
+            for (int y = 0; y < height && success; y++)
+                success = MagickCore::ExportImagePixels(image.constImage(), 0, y, width, 1, planeChannelMaps[plane], PixelStorage<T>::type, ptr + y * dst.stride[plane], exception) == MagickCore::MagickTrue;
+        }
+    }
+
+    throwTransferException(exception);
+}
+
+template<typename T>
+static void writeImageHelper(const ConstPlanes &src, Magick::Image &image, int width, int height, int bitsPerSample, bool allowSIMD) {
+    unsigned prepeat = (MAGICKCORE_QUANTUM_DEPTH - 1) / bitsPerSample;
+    unsigned pleftover = MAGICKCORE_QUANTUM_DEPTH - (bitsPerSample * prepeat);
+    unsigned shiftFactor = bitsPerSample - pleftover;
+    unsigned scaleFactor = 0;
+    for (unsigned i = 0; i < prepeat; i++) {
+        scaleFactor <<= bitsPerSample;
+        scaleFactor += 1;
+    }
+    scaleFactor <<= pleftover;
+
+    // basic downsampling support
+    if(bitsPerSample > MAGICKCORE_QUANTUM_DEPTH)
+        shiftFactor = bitsPerSample - MAGICKCORE_QUANTUM_DEPTH;
+
+    ssize_t rOff = channelOffset(image, MagickCore::RedPixelChannel);
+    ssize_t gOff = channelOffset(image, MagickCore::GreenPixelChannel);
+    ssize_t bOff = channelOffset(image, MagickCore::BluePixelChannel);
+    ssize_t aOff = channelOffset(image, MagickCore::AlphaPixelChannel);
+    size_t channels = image.channels();
+
+    // layouts without a vectorized path go through ImageMagick's import loops, decided before the view below exists
+    bool sseLayout = false;
+#ifdef HAVE_SSE2
+    sseLayout = sizeof(MagickCore::Quantum) <= 4 && MAGICKCORE_QUANTUM_DEPTH <= 32 && rOff == 0 && gOff == 1 && bOff == 2 &&
+        (src.ptr[3] ? channels == 4 && aOff == 3 : channels == 3) &&
+        ((sizeof(T) == 1 && bitsPerSample == 8) || (sizeof(T) == 2 && bitsPerSample >= 8 && (MAGICKCORE_QUANTUM_DEPTH <= 16 || bitsPerSample == 8 || bitsPerSample == 16)));
+#endif
+    if (allowSIMD && !sseLayout && isExactTransfer<T>(bitsPerSample)) {
+        importPlanes<T>(src, image, width, height);
+        return;
+    }
+
+    Magick::Pixels pixelCache(image);
+
+    const T * VS_RESTRICT r = static_cast<const T *>(src.ptr[0]);
+    const T * VS_RESTRICT g = static_cast<const T *>(src.ptr[1]);
+    const T * VS_RESTRICT b = static_cast<const T *>(src.ptr[2]);
+    ptrdiff_t strideR = src.stride[0];
+    ptrdiff_t strideG = src.stride[1];
+    ptrdiff_t strideB = src.stride[2];
+
+    if (src.ptr[3]) {
+        ptrdiff_t strideA = src.stride[3];
+        const T * VS_RESTRICT a = static_cast<const T *>(src.ptr[3]);
+
+        auto loopImage = [&](const std::function<void(MagickCore::Quantum *, int &)> &loopPixels) {
+            for (int y = 0; y < height; y++) {
+                MagickCore::Quantum *pixels = pixelCache.get(0, y, width, 1);
+                int x = 0;
+                loopPixels(pixels, x);
+                MagickCore::Quantum *p = pixels + x * channels;
+                for (; x < width; x++, p += channels) {
+                    p[rOff] = r[x] * scaleFactor + (r[x] >> shiftFactor);
+                    p[gOff] = g[x] * scaleFactor + (g[x] >> shiftFactor);
+                    p[bOff] = b[x] * scaleFactor + (b[x] >> shiftFactor);
+                    p[aOff] = a[x] * scaleFactor + (a[x] >> shiftFactor);
+                }
+
+                r += strideR / sizeof(T);
+                g += strideG / sizeof(T);
+                b += strideB / sizeof(T);
+                a += strideA / sizeof(T);
+
+                pixelCache.sync();
+            }
+        };
+#ifdef HAVE_SSE2
+        if (allowSIMD && sizeof(MagickCore::Quantum) <= 4 && MAGICKCORE_QUANTUM_DEPTH <= 32 && channels == 4 && rOff == 0 && gOff == 1 && bOff == 2 && aOff == 3) { // typical ImageMagick config
+            if (sizeof(T) == 1 && bitsPerSample == 8) {
+                loopImage([&](MagickCore::Quantum *pixels, int &x) {
+                    for (; x < width - 15; x += 16) {
+                        __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x));
+                        __m128i g0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x));
+                        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
+                        __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + x));
+
+                        // interleave
+                        __m128i rg0 = _mm_unpacklo_epi8(r0, g0);
+                        __m128i rg1 = _mm_unpackhi_epi8(r0, g0);
+                        __m128i ba0 = _mm_unpacklo_epi8(b0, a0);
+                        __m128i ba1 = _mm_unpackhi_epi8(b0, a0);
+
+                        __m128i rgba0 = _mm_unpacklo_epi16(rg0, ba0);
+                        __m128i rgba1 = _mm_unpackhi_epi16(rg0, ba0);
+                        __m128i rgba2 = _mm_unpacklo_epi16(rg1, ba1);
+                        __m128i rgba3 = _mm_unpackhi_epi16(rg1, ba1);
+
+                        sseWritePixels8(pixels + x * channels, (const __m128i[4]){
+                            rgba0, rgba1, rgba2, rgba3
+                        });
+                    }
+                });
+                return;
+            } else if (sizeof(T) == 2 && bitsPerSample >= 8 && (MAGICKCORE_QUANTUM_DEPTH <= 16 || bitsPerSample == 8 || bitsPerSample == 16)) { // TODO: consider supporting proper upsampling to 32-bit
+                loopImage([&](MagickCore::Quantum *pixels, int &x) {
+                    __m128i shl = _mm_set_epi32(0, bitsPerSample * 2 - 16, 0, 16 - bitsPerSample);
+                    __m128i shr = _mm_unpackhi_epi64(shl, shl);
+                    for (; x < width - 7; x += 8) {
+                        __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x));
+                        __m128i g0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x));
+                        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
+                        __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + x));
+
+                        // upsample pixels to 16-bit
+                        r0 = _mm_or_si128(_mm_sll_epi16(r0, shl), _mm_srl_epi16(r0, shr));
+                        g0 = _mm_or_si128(_mm_sll_epi16(g0, shl), _mm_srl_epi16(g0, shr));
+                        b0 = _mm_or_si128(_mm_sll_epi16(b0, shl), _mm_srl_epi16(b0, shr));
+                        a0 = _mm_or_si128(_mm_sll_epi16(a0, shl), _mm_srl_epi16(a0, shr));
+
+                        // interleave
+                        __m128i rg0 = _mm_unpacklo_epi16(r0, g0);
+                        __m128i rg1 = _mm_unpackhi_epi16(r0, g0);
+                        __m128i ba0 = _mm_unpacklo_epi16(b0, a0);
+                        __m128i ba1 = _mm_unpackhi_epi16(b0, a0);
+
+                        sseWritePixels16(pixels + x * channels, (const __m128i[4]){
+                            _mm_unpacklo_epi32(rg0, ba0),
+                            _mm_unpackhi_epi32(rg0, ba0),
+                            _mm_unpacklo_epi32(rg1, ba1),
+                            _mm_unpackhi_epi32(rg1, ba1)
+                        });
+                    }
+                });
+                return;
+            }
+        }
+#endif
+        loopImage([&](MagickCore::Quantum *pixels, int &x) {});
+    } else {
+        auto loopImage = [&](const std::function<void(MagickCore::Quantum *, int &)> &loopPixels) {
+            for (int y = 0; y < height; y++) {
+                MagickCore::Quantum *pixels = pixelCache.get(0, y, width, 1);
+                int x = 0;
+                loopPixels(pixels, x);
+                MagickCore::Quantum *p = pixels + x * channels;
+                for (; x < width; x++, p += channels) {
+                    p[rOff] = r[x] * scaleFactor + (r[x] >> shiftFactor);
+                    p[gOff] = g[x] * scaleFactor + (g[x] >> shiftFactor);
+                    p[bOff] = b[x] * scaleFactor + (b[x] >> shiftFactor);
+                }
+
+                r += strideR / sizeof(T);
+                g += strideG / sizeof(T);
+                b += strideB / sizeof(T);
+
+                pixelCache.sync();
+            }
+        };
+
+#ifdef HAVE_SSE2
+        if (allowSIMD && sizeof(MagickCore::Quantum) <= 4 && MAGICKCORE_QUANTUM_DEPTH <= 32 && channels == 3 && rOff == 0 && gOff == 1 && bOff == 2) { // typical ImageMagick config
+            if (sizeof(T) == 1 && bitsPerSample == 8) {
+                loopImage([&](MagickCore::Quantum *pixels, int &x) {
+                    for (; x < width - 31; x += 32) {
+                        __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x));
+                        __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x) + 1);
+                        __m128i g0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x));
+                        __m128i g1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x) + 1);
+                        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
+                        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x) + 1);
+
+                        // interleave pixels via repeated packing
+                        __m128i r01a, r01b, g01a, g01b, b01a, b01b;
+                        ssePackPair8(r01a, r01b, r0, r1);
+                        ssePackPair8(g01a, g01b, g0, g1);
+                        ssePackPair8(b01a, b01b, b0, b1);
+
+                        __m128i rg0, rg2, gb1, gb3, br0, br2;
+                        ssePackPair8(rg0, rg2, r01a, g01a);
+                        ssePackPair8(gb1, gb3, g01b, b01b);
+                        ssePackPair8(br0, br2, b01a, r01b);
+
+                        __m128i rgbr0, rgbr1, gbrg0, gbrg1, brgb0, brgb1;
+                        ssePackPair8(rgbr0, rgbr1, rg0, br0);
+                        ssePackPair8(gbrg0, gbrg1, gb1, rg2);
+                        ssePackPair8(brgb0, brgb1, br2, gb3);
+
+                        __m128i r_g0, r_g1, b_r0, b_r1, g_b0, g_b1;
+                        ssePackPair8(r_g0, r_g1, rgbr0, gbrg0);
+                        ssePackPair8(b_r0, b_r1, brgb0, rgbr1);
+                        ssePackPair8(g_b0, g_b1, gbrg1, brgb1);
+
+                        __m128i r_r0, r_r1, g_g0, g_g1, b_b0, b_b1;
+                        ssePackPair8(r_r0, r_r1, r_g0, b_r0);
+                        ssePackPair8(g_g0, g_g1, g_b0, r_g1);
+                        ssePackPair8(b_b0, b_b1, b_r1, g_b1);
+
+                        sseWritePixels8(pixels + x * channels, (const __m128i[6]){
+                            r_r0, g_g0, b_b0,
+                            r_r1, g_g1, b_b1
+                        });
+                    }
+                });
+                return;
+            } else if (sizeof(T) == 2 && bitsPerSample >= 8 && (MAGICKCORE_QUANTUM_DEPTH <= 16 || bitsPerSample == 8 || bitsPerSample == 16)) {
+                loopImage([&](MagickCore::Quantum *pixels, int &x) {
+                    __m128i shl = _mm_set_epi32(0, bitsPerSample * 2 - 16, 0, 16 - bitsPerSample);
+                    __m128i shr = _mm_unpackhi_epi64(shl, shl);
+                    for (; x < width - 15; x += 16) {
+                        __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x));
+                        __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x) + 1);
+                        __m128i g0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x));
+                        __m128i g1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x) + 1);
+                        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
+                        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x) + 1);
+
+                        // upsample pixels to 16-bit
+                        r0 = _mm_or_si128(_mm_sll_epi16(r0, shl), _mm_srl_epi16(r0, shr));
+                        r1 = _mm_or_si128(_mm_sll_epi16(r1, shl), _mm_srl_epi16(r1, shr));
+                        g0 = _mm_or_si128(_mm_sll_epi16(g0, shl), _mm_srl_epi16(g0, shr));
+                        g1 = _mm_or_si128(_mm_sll_epi16(g1, shl), _mm_srl_epi16(g1, shr));
+                        b0 = _mm_or_si128(_mm_sll_epi16(b0, shl), _mm_srl_epi16(b0, shr));
+                        b1 = _mm_or_si128(_mm_sll_epi16(b1, shl), _mm_srl_epi16(b1, shr));
+
+                        // interleave pixels via repeated packing
+                        __m128i r01a, r01b, g01a, g01b, b01a, b01b;
+                        ssePackPair16(r01a, r01b, r0, r1);
+                        ssePackPair16(g01a, g01b, g0, g1);
+                        ssePackPair16(b01a, b01b, b0, b1);
+
+                        __m128i rg0, rg2, gb1, gb3, br0, br2;
+                        ssePackPair16(rg0, rg2, r01a, g01a);
+                        ssePackPair16(gb1, gb3, g01b, b01b);
+                        ssePackPair16(br0, br2, b01a, r01b);
+
+                        __m128i rgbr0, rgbr1, gbrg0, gbrg1, brgb0, brgb1;
+                        ssePackPair16(rgbr0, rgbr1, rg0, br0);
+                        ssePackPair16(gbrg0, gbrg1, gb1, rg2);
+                        ssePackPair16(brgb0, brgb1, br2, gb3);
+
+                        __m128i r_g0, r_g1, b_r0, b_r1, g_b0, g_b1;
+                        ssePackPair16(r_g0, r_g1, rgbr0, gbrg0);
+                        ssePackPair16(b_r0, b_r1, brgb0, rgbr1);
+                        ssePackPair16(g_b0, g_b1, gbrg1, brgb1);
+
+                        sseWritePixels16(pixels + x * channels, (const __m128i[6]){
+                            r_g0, b_r0, g_b0,
+                            r_g1, b_r1, g_b1
+                        });
+                    }
+                });
+                return;
+            }
+        }
+#endif
+        loopImage([&](MagickCore::Quantum *pixels, int &x) {});
+    }
+}
+
+static void writeImageHelperFloat(const ConstPlanes &src, Magick::Image &image, int width, int height) {
+    Magick::Pixels pixelCache(image);
+    const float scaleFactor = QuantumRange;
+
+    const float * VS_RESTRICT r = static_cast<const float *>(src.ptr[0]);
+    const float * VS_RESTRICT g = static_cast<const float *>(src.ptr[1]);
+    const float * VS_RESTRICT b = static_cast<const float *>(src.ptr[2]);
+
+    ptrdiff_t strideR = src.stride[0];
+    ptrdiff_t strideG = src.stride[1];
+    ptrdiff_t strideB = src.stride[2];
+
+    ssize_t rOff = pixelCache.offset(MagickCore::RedPixelChannel);
+    ssize_t gOff = pixelCache.offset(MagickCore::GreenPixelChannel);
+    ssize_t bOff = pixelCache.offset(MagickCore::BluePixelChannel);
+    size_t channels = image.channels();
+
+    if (src.ptr[3]) {
+        const float * VS_RESTRICT a = static_cast<const float *>(src.ptr[3]);
+        ptrdiff_t strideA = src.stride[3];
+        ssize_t aOff = pixelCache.offset(MagickCore::AlphaPixelChannel);
+
+        for (int y = 0; y < height; y++) {
+            MagickCore::Quantum* pixels = pixelCache.get(0, y, width, 1);
+            MagickCore::Quantum *p = pixels;
+            for (int x = 0; x < width; x++, p += channels) {
+                p[rOff] = MagickCore::ClampToQuantum(r[x] * scaleFactor);
+                p[gOff] = MagickCore::ClampToQuantum(g[x] * scaleFactor);
+                p[bOff] = MagickCore::ClampToQuantum(b[x] * scaleFactor);
+                p[aOff] = MagickCore::ClampToQuantum(a[x] * scaleFactor);
+            }
+
+            r += strideR / sizeof(float);
+            g += strideG / sizeof(float);
+            b += strideB / sizeof(float);
+            a += strideA / sizeof(float);
+
+            pixelCache.sync();
+        }
+    } else {
+        for (int y = 0; y < height; y++) {
+            MagickCore::Quantum* pixels = pixelCache.get(0, y, width, 1);
+            MagickCore::Quantum *p = pixels;
+            for (int x = 0; x < width; x++, p += channels) {
+                p[rOff] = MagickCore::ClampToQuantum(r[x] * scaleFactor);
+                p[gOff] = MagickCore::ClampToQuantum(g[x] * scaleFactor);
+                p[bOff] = MagickCore::ClampToQuantum(b[x] * scaleFactor);
+            }
+
+            r += strideR / sizeof(float);
+            g += strideG / sizeof(float);
+            b += strideB / sizeof(float);
+
+            pixelCache.sync();
+        }
+    }
+}
+
+// Copies the planes into an image that has already been created with the right dimensions, colorspace and alpha channel.
+// allowSIMD only exists so the vectorized and bulk import paths can be checked against the scalar fallback.
+static void planesToImage(const ConstPlanes &src, Magick::Image &image, int width, int height, int bitsPerSample, int bytesPerSample, bool isFloat, bool allowSIMD = true) {
+    if (bytesPerSample == 4 && isFloat)
+        writeImageHelperFloat(src, image, width, height);
+    else if (bytesPerSample == 4)
+        writeImageHelper<uint32_t>(src, image, width, height, bitsPerSample, allowSIMD);
+    else if (bytesPerSample == 2)
+        writeImageHelper<uint16_t>(src, image, width, height, bitsPerSample, allowSIMD);
+    else if (bytesPerSample == 1)
+        writeImageHelper<uint8_t>(src, image, width, height, bitsPerSample, allowSIMD);
+}
+
+template<typename T>
+static void readImageHelper(const Planes &dst, Magick::Image &image, int width, int height, int bitsPerSample) {
+    float outScale = ((1u << bitsPerSample) - 1) / static_cast<float>(QuantumRange);
+    size_t channels = image.channels();
+    Magick::Pixels pixelCache(image);
+
+    T *r = static_cast<T *>(dst.ptr[0]);
+    T *g = static_cast<T *>(dst.ptr[1]);
+    T *b = static_cast<T *>(dst.ptr[2]);
+
+    ptrdiff_t strideR = dst.stride[0];
+    ptrdiff_t strideG = dst.stride[1];
+    ptrdiff_t strideB = dst.stride[2];
+
+    ssize_t rOff = pixelCache.offset(MagickCore::RedPixelChannel);
+    ssize_t gOff = pixelCache.offset(MagickCore::GreenPixelChannel);
+    ssize_t bOff = pixelCache.offset(MagickCore::BluePixelChannel);
+    ssize_t aOff = pixelCache.offset(MagickCore::AlphaPixelChannel);
+
+    if (dst.ptr[3] && aOff >= 0) {
+        T *a = static_cast<T *>(dst.ptr[3]);
+        ptrdiff_t strideA = dst.stride[3];
+
+        for (int y = 0; y < height; y++) {
+            const Magick::Quantum *pixels = pixelCache.getConst(0, y, width, 1);
+            const Magick::Quantum *p = pixels;
+            for (int x = 0; x < width; x++, p += channels) {
+                r[x] = (unsigned)(p[rOff] * outScale + .5f);
+                g[x] = (unsigned)(p[gOff] * outScale + .5f);
+                b[x] = (unsigned)(p[bOff] * outScale + .5f);
+                a[x] = (unsigned)(p[aOff] * outScale + .5f);
+            }
+
+            r += strideR / sizeof(T);
+            g += strideG / sizeof(T);
+            b += strideB / sizeof(T);
+            a += strideA / sizeof(T);
+        }
+    } else {
+        for (int y = 0; y < height; y++) {
+            const Magick::Quantum *pixels = pixelCache.getConst(0, y, width, 1);
+            const Magick::Quantum *p = pixels;
+            for (int x = 0; x < width; x++, p += channels) {
+                r[x] = (unsigned)(p[rOff] * outScale + .5f);
+                g[x] = (unsigned)(p[gOff] * outScale + .5f);
+                b[x] = (unsigned)(p[bOff] * outScale + .5f);
+            }
+
+            r += strideR / sizeof(T);
+            g += strideG / sizeof(T);
+            b += strideB / sizeof(T);
+        }
+
+        if (dst.ptr[3])
+            memset(dst.ptr[3], 0, dst.stride[3] * height);
+    }
+}
+
+static void readImageHelperFloat(const Planes &dst, Magick::Image &image, int width, int height) {
+    const float scaleFactor = QuantumRange;
+    size_t channels = image.channels();
+    Magick::Pixels pixelCache(image);
+
+    float *r = static_cast<float *>(dst.ptr[0]);
+    float *g = static_cast<float *>(dst.ptr[1]);
+    float *b = static_cast<float *>(dst.ptr[2]);
+
+    ptrdiff_t strideR = dst.stride[0];
+    ptrdiff_t strideG = dst.stride[1];
+    ptrdiff_t strideB = dst.stride[2];
+
+    ssize_t rOff = pixelCache.offset(MagickCore::RedPixelChannel);
+    ssize_t gOff = pixelCache.offset(MagickCore::GreenPixelChannel);
+    ssize_t bOff = pixelCache.offset(MagickCore::BluePixelChannel);
+    ssize_t aOff = pixelCache.offset(MagickCore::AlphaPixelChannel);
+
+    if (dst.ptr[3] && aOff >= 0) {
+        float *a = static_cast<float *>(dst.ptr[3]);
+        ptrdiff_t strideA = dst.stride[3];
+
+        for (int y = 0; y < height; y++) {
+            const MagickCore::Quantum *pixels = pixelCache.getConst(0, y, width, 1);
+            const MagickCore::Quantum *p = pixels;
+            for (int x = 0; x < width; x++, p += channels) {
+                r[x] = p[rOff] / scaleFactor;
+                g[x] = p[gOff] / scaleFactor;
+                b[x] = p[bOff] / scaleFactor;
+                a[x] = p[aOff] / scaleFactor;
+            }
+
+            r += strideR / sizeof(float);
+            g += strideG / sizeof(float);
+            b += strideB / sizeof(float);
+            a += strideA / sizeof(float);
+        }
+    } else {
+        for (int y = 0; y < height; y++) {
+            const MagickCore::Quantum *pixels = pixelCache.getConst(0, y, width, 1);
+            const MagickCore::Quantum *p = pixels;
+            for (int x = 0; x < width; x++, p += channels) {
+                r[x] = p[rOff] / scaleFactor;
+                g[x] = p[gOff] / scaleFactor;
+                b[x] = p[bOff] / scaleFactor;
+            }
+
+            r += strideR / sizeof(float);
+            g += strideG / sizeof(float);
+            b += strideB / sizeof(float);
+        }
+
+        if (dst.ptr[3])
+            memset(dst.ptr[3], 0, dst.stride[3] * height);
+    }
+}
+
+// Copies the image into the planes, an alpha plane is zeroed if the image has no alpha channel.
+// allowBulk only exists so the bulk export path can be checked against the scalar loops.
+static void imageToPlanes(Magick::Image &image, const Planes &dst, int width, int height, int bitsPerSample, int bytesPerSample, bool isFloat, bool allowBulk = true) {
+    if (bytesPerSample == 4 && isFloat)
+        readImageHelperFloat(dst, image, width, height);
+    else if (bytesPerSample == 2 && allowBulk && isExactTransfer<uint16_t>(bitsPerSample))
+        exportPlanes<uint16_t>(dst, image, width, height);
+    else if (bytesPerSample == 1 && allowBulk && isExactTransfer<uint8_t>(bitsPerSample))
+        exportPlanes<uint8_t>(dst, image, width, height);
+    else if (bytesPerSample == 4)
+        readImageHelper<uint32_t>(dst, image, width, height, bitsPerSample);
+    else if (bytesPerSample == 2)
+        readImageHelper<uint16_t>(dst, image, width, height, bitsPerSample);
+    else if (bytesPerSample == 1)
+        readImageHelper<uint8_t>(dst, image, width, height, bitsPerSample);
+}
+
+// Depth reduction with ordered or blue noise dithering, done on the planes before they're handed to an
+// encoder so that the image can be created at the target depth. Every threshold comes from a 64x64 matrix
+// of ranks that's tiled over the plane, which keeps each row independent so bands can run in parallel.
+
+enum DitherType {
+    ditherNone,
+    ditherOrdered,
+    ditherBlueNoise
+};
+
+static const int ditherMatrixSize = 64;
+static const int ditherMatrixCount = ditherMatrixSize * ditherMatrixSize;
+
+// Blue noise ranks generated with the void-and-cluster method, computed once on first use
+static const uint16_t *blueNoiseRanks() {
+    static const std::vector<uint16_t> ranks = []() {
+        const int size = ditherMatrixSize;
+        const int mask = size - 1;
+        const int count = ditherMatrixCount;
+
+        std::vector<float> kernel(count);
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                int dx = std::min(x, size - x);
+                int dy = std::min(y, size - y);
+                kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2 * 1.5f * 1.5f));
+            }
+        }
+
+        std::vector<uint8_t> pattern(count);
+        std::vector<float> energy(count);
+        auto toggle = [&](int p, bool set) {
+            pattern[p] = set;
+            float sign = set ? 1.f : -1.f;
+            int px = p % size;
+            int py = p / size;
+            for (int y = 0; y < size; y++)
+                for (int x = 0; x < size; x++)
+                    energy[y * size + x] += sign * kernel[((y - py) & mask) * size + ((x - px) & mask)];
+        };
+        auto tightestCluster = [&]() {
+            int best = -1;
+            for (int p = 0; p < count; p++)
+                if (pattern[p] && (best < 0 || energy[p] > energy[best]))
+                    best = p;
+            return best;
+        };
+        auto largestVoid = [&]() {
+            int best = -1;
+            for (int p = 0; p < count; p++)
+                if (!pattern[p] && (best < 0 || energy[p] < energy[best]))
+                    best = p;
+            return best;
+        };
+
+        // a fixed random starting pattern that's spread out by moving points from clusters to voids
+        int ones = 0;
+        uint32_t seed = 12345;
+        while (ones < count / 10) {
+            seed = seed * 1664525 + 1013904223;
+            int p = (seed >> 8) % count;
+            if (!pattern[p]) {
+                toggle(p, true);
+                ones++;
+            }
+        }
+        for (;;) {
+            int cluster = tightestCluster();
+            toggle(cluster, false);
+            int gap = largestVoid();
+            toggle(gap, true);
+            if (gap == cluster)
+                break;
+        }
+
+        std::vector<uint16_t> result(count);
+        std::vector<uint8_t> initialPattern(pattern);
+        std::vector<float> initialEnergy(energy);
+        for (int rank = ones - 1; rank >= 0; rank--) {
+            int cluster = tightestCluster();
+            toggle(cluster, false);
+            result[cluster] = static_cast<uint16_t>(rank);
+        }
+        pattern = initialPattern;
+        energy = initialEnergy;
+        for (int rank = ones; rank < count; rank++) {
+            int gap = largestVoid();
+            toggle(gap, true);
+            result[gap] = static_cast<uint16_t>(rank);
+        }
+        return result;
+    }();
+    return ranks.data();
+}
+
+// Thresholds added to the samples before they're truncated to the target depth. The integer ones are for
+// dropping the low shift bits and the float ones are fractions of a step at the target depth.
+struct DitherMatrix {
+    uint16_t intThresholds[ditherMatrixCount];
+    float floatThresholds[ditherMatrixCount];
+
+    DitherMatrix(DitherType type, int shift) {
+        const uint16_t *blueNoise = type == ditherBlueNoise ? blueNoiseRanks() : nullptr;
+        for (int y = 0; y < ditherMatrixSize; y++) {
+            for (int x = 0; x < ditherMatrixSize; x++) {
+                int i = y * ditherMatrixSize + x;
+                // ranks are spread over 0-4095 so every kind of matrix maps to thresholds the same way
+                int rank = ditherMatrixCount / 2;
+                if (type == ditherBlueNoise) {
+                    rank = blueNoise[i];
+                } else if (type == ditherOrdered) {
+                    int bayer = 0;
+                    for (int bit = 0; bit < 3; bit++)
+                        bayer = (bayer << 2) | ((((x >> bit) ^ (y >> bit)) & 1) << 1) | ((y >> bit) & 1);
+                    rank = bayer * (ditherMatrixCount / 64) + ditherMatrixCount / 128;
+                }
+                intThresholds[i] = static_cast<uint16_t>(((2 * rank + 1) << shift) / (2 * ditherMatrixCount));
+                floatThresholds[i] = (2 * rank + 1) / static_cast<float>(2 * ditherMatrixCount);
+            }
+        }
+    }
+};
+
+// Reduces rows of 9-16 bit samples by shift bits to depth, y is the row number in the plane and picks the
+// matrix row. Strides are in bytes.
+template<typename T>
+static void ditherRows(const uint16_t *src, ptrdiff_t srcStride, T *dst, ptrdiff_t dstStride, int width, int y, int rows, int shift, int depth, const DitherMatrix &matrix) {
+    const int maxValue = (1 << depth) - 1;
+    for (int row = 0; row < rows; row++) {
+        const uint16_t * VS_RESTRICT s = reinterpret_cast<const uint16_t *>(reinterpret_cast<const uint8_t *>(src) + row * srcStride);
+        T * VS_RESTRICT d = reinterpret_cast<T *>(reinterpret_cast<uint8_t *>(dst) + row * dstStride);
+        const uint16_t *thresholds = matrix.intThresholds + ((y + row) & (ditherMatrixSize - 1)) * ditherMatrixSize;
+
+        int x = 0;
+#ifdef HAVE_SSE2
+        const __m128i shiftCount = _mm_cvtsi32_si128(shift);
+        const __m128i maxVec = _mm_set1_epi16(static_cast<int16_t>(maxValue));
+        for (; x < width - 7; x += 8) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + x));
+            __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i *>(thresholds + (x & (ditherMatrixSize - 1))));
+            v = _mm_min_epi16(_mm_srl_epi16(_mm_adds_epu16(v, t), shiftCount), maxVec);
+            if (sizeof(T) == 1)
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(d + x), _mm_packus_epi16(v, v));
+            else
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(d + x), v);
+        }
+#endif
+        for (; x < width; x++)
+            d[x] = static_cast<T>(std::min<int>((s[x] + thresholds[x & (ditherMatrixSize - 1)]) >> shift, maxValue));
+    }
+}
+
+// Same as ditherRows() for float samples in the 0-1 range, anything outside of it (and NaN) is clamped
+template<typename T>
+static void ditherRowsFloat(const float *src, ptrdiff_t srcStride, T *dst, ptrdiff_t dstStride, int width, int y, int rows, int depth, const DitherMatrix &matrix) {
+    const float maxValue = static_cast<float>((1 << depth) - 1);
+    for (int row = 0; row < rows; row++) {
+        const float * VS_RESTRICT s = reinterpret_cast<const float *>(reinterpret_cast<const uint8_t *>(src) + row * srcStride);
+        T * VS_RESTRICT d = reinterpret_cast<T *>(reinterpret_cast<uint8_t *>(dst) + row * dstStride);
+        const float *thresholds = matrix.floatThresholds + ((y + row) & (ditherMatrixSize - 1)) * ditherMatrixSize;
+        for (int x = 0; x < width; x++)
+            d[x] = static_cast<T>(std::min(maxValue, std::max(0.f, s[x] * maxValue + thresholds[x & (ditherMatrixSize - 1)])));
+    }
+}
+
+#endif
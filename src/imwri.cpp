@@ -27,6 +27,7 @@
 #include <Magick++.h>
 #include <VapourSynth4.h>
 #include <VSHelper4.h>
+#include <VSConstants4.h>
 #include <cstring>
 #include <string>
 #include <vector>
@@ -34,14 +35,57 @@
 #include <memory>
 #include <functional>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <cerrno>
+#include <cinttypes>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include "conversion.h"
+
+#if defined(IMWRI_HAS_TURBOJPEG)
+#include <turbojpeg.h>
+#endif
+
+#if defined(IMWRI_HAS_ZLIB)
+#include "pngencoder.h"
+#endif
+
+#if defined(IMWRI_HAS_OPENEXR)
+#include <OpenEXRConfig.h>
+#include <ImfIO.h>
+#include <ImfHeader.h>
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfMultiPartInputFile.h>
+#include <ImfInputPart.h>
+#include <ImfOutputFile.h>
+#include <ImfThreading.h>
+#endif
 
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
 #include <windows.h>
 #include "vsutf16.h"
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#elif defined(__APPLE__)
+#include <sys/clonefile.h>
+#endif
 #endif
 
 
@@ -51,7 +95,9 @@
 #define IMWRI_PLUGIN_NAME "VapourSynth ImageMagick 7 HDRI Writer/Reader"
 #define IMWRI_ID "com.vapoursynth.imwri"
 #else
-#error ImageMagick must be compiled with HDRI enabled
+#define IMWRI_NAMESPACE "imwri"
+#define IMWRI_PLUGIN_NAME "VapourSynth ImageMagick 7 Writer/Reader"
+#define IMWRI_ID "com.vapoursynth.imwri"
 #endif
 
 #if MAGICKCORE_QUANTUM_DEPTH > 32
@@ -68,6 +114,32 @@ using MagickCore::Quantum;
 //////////////////////////////////////////
 // Shared
 
+// VapourSynth already processes numThreads frames in parallel so by default ImageMagick's own OpenMP threads
+// only get to use the cores that would otherwise be left idle, the MAGICK_THREAD_LIMIT environment variable
+// and SetResources() both take precedence
+static int defaultImageThreads(VSCore *core, const VSAPI *vsapi) {
+    VSCoreInfo info;
+    vsapi->getCoreInfo(core, &info);
+    unsigned hwThreads = std::thread::hardware_concurrency();
+    if (hwThreads && info.numThreads > 0)
+        return static_cast<int>(std::max(1u, hwThreads / static_cast<unsigned>(info.numThreads)));
+    return 1;
+}
+
+static void setDefaultResources(VSCore *core, const VSAPI *vsapi) {
+    if (getenv("MAGICK_THREAD_LIMIT"))
+        return;
+    Magick::ResourceLimits::thread(std::min<MagickCore::MagickSizeType>(defaultImageThreads(core, vsapi), Magick::ResourceLimits::thread()));
+}
+
+// The number of threads IMWRI's own encoders use for a single image, 0 until set with SetResources
+static std::atomic<int> imageThreads(0);
+
+static int getImageThreads(VSCore *core, const VSAPI *vsapi) {
+    int threads = imageThreads;
+    return threads ? threads : defaultImageThreads(core, vsapi);
+}
+
 std::once_flag initMagickFlag;
 static void initMagick(VSCore *core, const VSAPI *vsapi) {
     std::call_once(initMagickFlag, [=]() {
@@ -82,6 +154,7 @@ static void initMagick(VSCore *core, const VSAPI *vsapi) {
         }
 #endif
         Magick::InitializeMagick(path.c_str());
+        setDefaultResources(core, vsapi);
     });
 }
 
@@ -134,6 +207,89 @@ static std::string specialPrintf(const std::string &filename, int number) {
     return result;
 }
 
+// Streaming implementation of the XXH64 hash, fast enough to checksum whole frames
+class Hasher {
+    static constexpr uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t prime3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+    uint64_t v[4];
+    uint64_t totalLength = 0;
+    unsigned char buffer[32];
+    size_t buffered = 0;
+
+    static inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static inline uint64_t read64(const unsigned char *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+    static inline uint32_t read32(const unsigned char *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+    static inline uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * prime2, 31) * prime1; }
+    static inline uint64_t mergeRound(uint64_t acc, uint64_t val) { return (acc ^ round(0, val)) * prime1 + prime4; }
+
+    void stripe(const unsigned char *p) {
+        v[0] = round(v[0], read64(p));
+        v[1] = round(v[1], read64(p + 8));
+        v[2] = round(v[2], read64(p + 16));
+        v[3] = round(v[3], read64(p + 24));
+    }
+public:
+    explicit Hasher(uint64_t seed = 0) : v{ seed + prime1 + prime2, seed + prime2, seed, seed - prime1 } {}
+
+    void update(const void *data, size_t length) {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        totalLength += length;
+
+        if (buffered) {
+            size_t n = std::min(length, sizeof(buffer) - buffered);
+            memcpy(buffer + buffered, p, n);
+            buffered += n;
+            p += n;
+            length -= n;
+            if (buffered < sizeof(buffer))
+                return;
+            stripe(buffer);
+            buffered = 0;
+        }
+
+        for (; length >= 32; p += 32, length -= 32)
+            stripe(p);
+
+        memcpy(buffer, p, length);
+        buffered = length;
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if (totalLength >= 32) {
+            h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+            for (int i = 0; i < 4; i++)
+                h = mergeRound(h, v[i]);
+        } else {
+            h = v[2] + prime5;
+        }
+        h += totalLength;
+
+        const unsigned char *p = buffer;
+        size_t length = buffered;
+        for (; length >= 8; p += 8, length -= 8)
+            h = rotl(h ^ round(0, read64(p)), 27) * prime1 + prime4;
+        if (length >= 4) {
+            h = rotl(h ^ (read32(p) * prime1), 23) * prime2 + prime3;
+            p += 4;
+            length -= 4;
+        }
+        for (; length > 0; p++, length--)
+            h = rotl(h ^ (*p * prime5), 11) * prime1;
+
+        h ^= h >> 33;
+        h *= prime2;
+        h ^= h >> 29;
+        h *= prime3;
+        h ^= h >> 32;
+        return h;
+    }
+};
+
 static bool isAbsolute(const std::string &path) {
 #ifdef _WIN32
     return path.size() > 1 && ((path[0] == '/' && path[1] == '/') || (path[0] == '\\' && path[1] == '\\') || path[1] == ':');
@@ -153,6 +309,170 @@ static bool fileExists(const std::string &filename) {
     return !!f;
 }
 
+static FILE *openFile(const std::string &filename, const char *mode) {
+#ifdef _WIN32
+    return _wfopen(utf16_from_utf8(filename).c_str(), utf16_from_utf8(mode).c_str());
+#else
+    return fopen(filename.c_str(), mode);
+#endif
+}
+
+// Size and modification time in nanoseconds where the file system has that resolution, also works for directories
+static bool getFileSizeAndTime(const std::string &path, uint64_t &size, int64_t &mtime) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExW(utf16_from_utf8(path).c_str(), GetFileExInfoStandard, &data))
+        return false;
+    size = (static_cast<uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+    // 100 ns units since 1601
+    int64_t ticks = static_cast<int64_t>((static_cast<uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime);
+    mtime = (ticks - INT64_C(116444736000000000)) * 100;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st))
+        return false;
+    size = st.st_size;
+#if defined(__APPLE__)
+    mtime = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+    return true;
+}
+
+static bool getModificationTime(const std::string &path, int64_t &mtime) {
+    uint64_t size;
+    return getFileSizeAndTime(path, size, mtime);
+}
+
+static bool writeToFd(int fd, const void *data, size_t size) {
+    const char *p = static_cast<const char *>(data);
+    while (size > 0) {
+#ifdef _WIN32
+        int written = _write(fd, p, static_cast<unsigned>(std::min<size_t>(size, INT_MAX)));
+#else
+        ssize_t written = write(fd, p, size);
+#endif
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += written;
+        size -= written;
+    }
+    return true;
+}
+
+static bool writeFile(const std::string &filename, const void *data, size_t size, bool sync) {
+#ifdef _WIN32
+    int fd = _wopen(utf16_from_utf8(filename).c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+#endif
+    if (fd < 0)
+        return false;
+
+    bool success = writeToFd(fd, data, size);
+#ifdef _WIN32
+    if (success && sync)
+        success = !_commit(fd);
+    int error = errno;
+    _close(fd);
+#else
+    if (success && sync)
+        success = !fsync(fd);
+    int error = errno;
+    close(fd);
+#endif
+    errno = error;
+    return success;
+}
+
+static bool syncFile(const std::string &filename) {
+#ifdef _WIN32
+    int fd = _wopen(utf16_from_utf8(filename).c_str(), _O_RDWR | _O_BINARY);
+    if (fd < 0)
+        return false;
+    bool success = !_commit(fd);
+    int error = errno;
+    _close(fd);
+#else
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool success = !fsync(fd);
+    int error = errno;
+    close(fd);
+#endif
+    errno = error;
+    return success;
+}
+
+// makes renames within the directory containing filename durable, a no-op on Windows where this isn't needed
+static void syncParentDirectory(const std::string &filename) {
+#ifndef _WIN32
+    size_t pos = filename.find_last_of('/');
+    std::string dir = (pos == std::string::npos) ? "." : filename.substr(0, pos + 1);
+    int fd = open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+#endif
+}
+
+// atomically replaces newname with oldname
+static bool renameFile(const std::string &oldname, const std::string &newname) {
+#ifdef _WIN32
+    if (MoveFileExW(utf16_from_utf8(oldname).c_str(), utf16_from_utf8(newname).c_str(), MOVEFILE_REPLACE_EXISTING))
+        return true;
+    errno = EIO;
+    return false;
+#else
+    return !rename(oldname.c_str(), newname.c_str());
+#endif
+}
+
+static void removeFile(const std::string &filename) {
+#ifdef _WIN32
+    DeleteFileW(utf16_from_utf8(filename).c_str());
+#else
+    unlink(filename.c_str());
+#endif
+}
+
+// Creates newname with the contents of oldname without copying them, as a copy-on-write clone where the file
+// system supports it and as a hard link otherwise. Fails if newname already exists.
+static bool cloneFile(const std::string &oldname, const std::string &newname) {
+#ifdef _WIN32
+    if (CreateHardLinkW(utf16_from_utf8(newname).c_str(), utf16_from_utf8(oldname).c_str(), nullptr))
+        return true;
+    errno = EIO;
+    return false;
+#else
+#if defined(__linux__) && defined(FICLONE)
+    int src = open(oldname.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src >= 0) {
+        int dst = open(newname.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        bool cloned = dst >= 0 && !ioctl(dst, FICLONE, src);
+        if (dst >= 0)
+            close(dst);
+        if (dst >= 0 && !cloned)
+            unlink(newname.c_str());
+        close(src);
+        if (cloned)
+            return true;
+    }
+#elif defined(__APPLE__)
+    if (!clonefile(oldname.c_str(), newname.c_str(), 0))
+        return true;
+#endif
+    return !link(oldname.c_str(), newname.c_str());
+#endif
+}
+
 static void getWorkingDir(std::string &path) {
 #ifdef _WIN32
     DWORD size = GetCurrentDirectoryW(0, nullptr);
@@ -172,620 +492,1896 @@ static void getWorkingDir(std::string &path) {
 #endif
 }
 
-//////////////////////////////////////////
-// Write
-
-struct WriteData {
-    VSNode *videoNode;
-    VSNode *alphaNode;
-    const VSVideoInfo *vi;
-    std::string imgFormat;
-    std::string filename;
-    std::string workingDir;
-    int firstNum;
-    int quality;
-    MagickCore::CompressionType compressType;
-    bool dither;
-    bool overwrite;
+// Appends the names of all entries in a directory
+static bool listDirectory(const std::string &dir, std::vector<std::string> &names) {
+#ifdef _WIN32
+    WIN32_FIND_DATAW data;
+    HANDLE h = FindFirstFileW(utf16_from_utf8(dir + "\\*").c_str(), &data);
+    if (h == INVALID_HANDLE_VALUE)
+        return false;
+    do {
+        names.push_back(utf16_to_utf8(data.cFileName));
+    } while (FindNextFileW(h, &data));
+    FindClose(h);
+#else
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return false;
+    while (struct dirent *entry = readdir(d))
+        names.push_back(entry->d_name);
+    closedir(d);
+#endif
+    return true;
+}
 
-    WriteData() : videoNode(nullptr), alphaNode(nullptr), vi(nullptr), quality(0), compressType(MagickCore::UndefinedCompression), dither(true) {}
-};
+// The directory a path is in, . for bare file names
+static std::string patternDirectory(const std::string &pattern) {
+#ifdef _WIN32
+    size_t pos = pattern.find_last_of("/\\");
+#else
+    size_t pos = pattern.find_last_of('/');
+#endif
+    if (pos == std::string::npos)
+        return ".";
+    return pos ? pattern.substr(0, pos) : pattern.substr(0, 1);
+}
 
-#if defined(__SSE2__) || (defined(_MSC_VER) && !defined(__clang__) && ((defined(_M_IX86_FP) && _M_IX86_FP == 2) || defined(_M_X64)))
-#include <emmintrin.h>
-#define HAVE_SSE2 1
-
-static inline void ssePackPair8(__m128i &outLo, __m128i &outHi, __m128i a, __m128i b) {
-    outLo = _mm_packus_epi16(
-        _mm_and_si128(a, _mm_set1_epi16(0xff)),
-        _mm_and_si128(b, _mm_set1_epi16(0xff))
-    );
-    outHi = _mm_packus_epi16(
-        _mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)
-    );
-}
-static inline void ssePackPair16(__m128i &outLo, __m128i &outHi, __m128i a, __m128i b) {
-    // swap middle two 16-bit words in every 64-bit block
-    a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a, _MM_SHUFFLE(3,1,2,0)), _MM_SHUFFLE(3,1,2,0));
-    b = _mm_shufflehi_epi16(_mm_shufflelo_epi16(b, _MM_SHUFFLE(3,1,2,0)), _MM_SHUFFLE(3,1,2,0));
-
-    // pull alternating 32-bit blocks
-    outLo = _mm_castps_si128(_mm_shuffle_ps(
-        _mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2,0,2,0)
-    ));
-    outHi = _mm_castps_si128(_mm_shuffle_ps(
-        _mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3,1,3,1)
-    ));
-}
-
-template <std::size_t N>
-static inline void sseWritePixels8(void *dst, const __m128i (&vecs)[N]) {
-#ifdef MAGICKCORE_HDRI_SUPPORT
-    // pixels are always 32-bit float
-    float *p = reinterpret_cast<float*>(dst);
-    for (__m128i vec : vecs) {
-        __m128i vec0, vec1;
-        if (MAGICKCORE_QUANTUM_DEPTH == 8) {
-            vec0 = _mm_unpacklo_epi8(vec, _mm_setzero_si128());
-            vec1 = _mm_unpackhi_epi8(vec, _mm_setzero_si128());
-        } else {
-            vec0 = _mm_unpacklo_epi8(vec, vec);
-            vec1 = _mm_unpackhi_epi8(vec, vec);
-        }
-
-        __m128 vec00 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(vec0, _mm_setzero_si128()));
-        __m128 vec01 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(vec0, _mm_setzero_si128()));
-        __m128 vec10 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(vec1, _mm_setzero_si128()));
-        __m128 vec11 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(vec1, _mm_setzero_si128()));
-        if (MAGICKCORE_QUANTUM_DEPTH == 32) {
-            vec00 = _mm_mul_ps(vec00, _mm_set1_ps(65537.0));
-            vec01 = _mm_mul_ps(vec01, _mm_set1_ps(65537.0));
-            vec10 = _mm_mul_ps(vec10, _mm_set1_ps(65537.0));
-            vec11 = _mm_mul_ps(vec11, _mm_set1_ps(65537.0));
-        }
-        _mm_storeu_ps(p, vec00);
-        _mm_storeu_ps(p + 4, vec01);
-        _mm_storeu_ps(p + 8, vec10);
-        _mm_storeu_ps(p +12, vec11);
-        p += 16;
-    }
+// The part of a path after the last directory separator
+static std::string patternName(const std::string &pattern) {
+#ifdef _WIN32
+    size_t pos = pattern.find_last_of("/\\");
 #else
-    __m128i *p = reinterpret_cast<__m128i*>(dst);
-    if (sizeof(MagickCore::Quantum) == 1) {
-        for (__m128i vec : vecs)
-            _mm_storeu_si128(p++, vec);
-    } else {
-        for (__m128i vec : vecs) {
-            __m128i vec0, vec1;
-            if (MAGICKCORE_QUANTUM_DEPTH == 8) {
-                vec0 = _mm_unpacklo_epi8(vec, _mm_setzero_si128());
-                vec1 = _mm_unpackhi_epi8(vec, _mm_setzero_si128());
-            } else {
-                vec0 = _mm_unpacklo_epi8(vec, vec);
-                vec1 = _mm_unpackhi_epi8(vec, vec);
-            }
-            if (sizeof(MagickCore::Quantum) == 4) {
-                if (MAGICKCORE_QUANTUM_DEPTH == 32) {
-                    _mm_storeu_si128(p++, _mm_unpacklo_epi16(vec0, vec0));
-                    _mm_storeu_si128(p++, _mm_unpackhi_epi16(vec0, vec0));
-                    _mm_storeu_si128(p++, _mm_unpacklo_epi16(vec1, vec1));
-                    _mm_storeu_si128(p++, _mm_unpackhi_epi16(vec1, vec1));
-                } else { // 8 or 16
-                    _mm_storeu_si128(p++, _mm_unpacklo_epi16(vec0, _mm_setzero_si128()));
-                    _mm_storeu_si128(p++, _mm_unpackhi_epi16(vec0, _mm_setzero_si128()));
-                    _mm_storeu_si128(p++, _mm_unpacklo_epi16(vec1, _mm_setzero_si128()));
-                    _mm_storeu_si128(p++, _mm_unpackhi_epi16(vec1, _mm_setzero_si128()));
-                }
-            } else { // sizeof(MagickCore::Quantum) == 2
-                _mm_storeu_si128(p++, vec0);
-                _mm_storeu_si128(p++, vec1);
-            }
-        }
-    }
+    size_t pos = pattern.find_last_of('/');
 #endif
+    return pos == std::string::npos ? pattern : pattern.substr(pos + 1);
 }
-template <std::size_t N>
-static inline void sseWritePixels16(void *dst, const __m128i (&vecs)[N]) {
-#ifdef MAGICKCORE_HDRI_SUPPORT
-    // pixels are always 32-bit float (64-bit float unsupported here)
-    float *p = reinterpret_cast<float*>(dst);
-    for (__m128i vec : vecs) {
-        if (MAGICKCORE_QUANTUM_DEPTH == 8)
-            vec = _mm_srli_epi16(vec, 8);
 
-        __m128 vec0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(vec, _mm_setzero_si128()));
-        __m128 vec1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(vec, _mm_setzero_si128()));
-        if (MAGICKCORE_QUANTUM_DEPTH == 32) {
-            vec0 = _mm_mul_ps(vec0, _mm_set1_ps(65537.0));
-            vec1 = _mm_mul_ps(vec1, _mm_set1_ps(65537.0));
+// Finds the numbers of all files in the pattern's directory that match it, are at least firstNum and a multiple
+// of step after it, sorted. Replaces probing every number one by one which can't see past the first gap.
+static bool scanSequence(const std::string &pattern, int firstNum, int step, std::vector<int> &numbers) {
+    std::vector<std::string> names;
+    if (!listDirectory(patternDirectory(pattern), names))
+        return false;
+
+    // the number starts where the names of two very different numbers stop being the same
+    std::string namePattern = patternName(pattern);
+    std::string a = specialPrintf(namePattern, 0);
+    std::string b = specialPrintf(namePattern, 123456789);
+    size_t prefix = 0;
+    while (prefix < a.length() && prefix < b.length() && a[prefix] == b[prefix])
+        prefix++;
+
+    for (const auto &name : names) {
+        if (name.compare(0, prefix, a, 0, prefix))
+            continue;
+        size_t pos = prefix;
+        while (pos < name.length() && name[pos] == ' ')
+            pos++;
+        int64_t number = 0;
+        size_t digits = 0;
+        while (pos < name.length() && name[pos] >= '0' && name[pos] <= '9' && digits < 10) {
+            number = number * 10 + (name[pos++] - '0');
+            digits++;
         }
-        _mm_storeu_ps(p, vec0);
-        _mm_storeu_ps(p + 4, vec1);
-        p += 8;
+        if (!digits || number > INT_MAX || number < firstNum || (number - firstNum) % step)
+            continue;
+        // the whole name has to match, this also rejects other paddings and trailing characters
+        if (specialPrintf(namePattern, static_cast<int>(number)) == name)
+            numbers.push_back(static_cast<int>(number));
     }
+
+    std::sort(numbers.begin(), numbers.end());
+    numbers.erase(std::unique(numbers.begin(), numbers.end()), numbers.end());
+    return true;
+}
+
+static bool readFile(const std::string &filename, std::vector<unsigned char> &buffer) {
+    FILE *f = openFile(filename, "rb");
+    if (!f)
+        return false;
+
+    bool success = false;
+#ifdef _WIN32
+    if (!_fseeki64(f, 0, SEEK_END)) {
+        int64_t size = _ftelli64(f);
 #else
-    __m128i *p = reinterpret_cast<__m128i*>(dst);
-    if (sizeof(MagickCore::Quantum) == 1) {
-        for (int i = 0; i < N; i += 2) {
-            __m128i vec0 = vecs[i], vec1 = vecs[i + 1];
-            vec0 = _mm_srli_epi16(vec0, 8); // should rounding be done here?
-            vec1 = _mm_srli_epi16(vec1, 8);
-            _mm_storeu_si128(p++, _mm_packus_epi16(vec0, vec1));
-        }
-    } else {
-        for (__m128i vec : vecs) {
-            if (sizeof(MagickCore::Quantum) == 4) {
-                if (MAGICKCORE_QUANTUM_DEPTH == 32) {
-                    _mm_storeu_si128(p++, _mm_unpacklo_epi16(vec, vec));
-                    _mm_storeu_si128(p++, _mm_unpackhi_epi16(vec, vec));
-                } else { // 8 or 16
-                    if (MAGICKCORE_QUANTUM_DEPTH == 8)
-                        vec = _mm_srli_epi16(vec, 8);
-                    _mm_storeu_si128(p++, _mm_unpacklo_epi16(vec, _mm_setzero_si128()));
-                    _mm_storeu_si128(p++, _mm_unpackhi_epi16(vec, _mm_setzero_si128()));
-                }
-            } else { // sizeof(MagickCore::Quantum) == 2
-                if (MAGICKCORE_QUANTUM_DEPTH == 8)
-                    vec = _mm_srli_epi16(vec, 8);
-                _mm_storeu_si128(p++, vec);
-            }
+    if (!fseeko(f, 0, SEEK_END)) {
+        int64_t size = ftello(f);
+#endif
+        if (size >= 0 && !fseek(f, 0, SEEK_SET)) {
+            buffer.resize(static_cast<size_t>(size));
+            success = fread(buffer.data(), 1, buffer.size(), f) == buffer.size();
         }
     }
-#endif
+
+    int error = errno;
+    fclose(f);
+    errno = error;
+    return success;
+}
+
+#if defined(IMWRI_HAS_TURBOJPEG) || defined(IMWRI_HAS_OPENEXR)
+// Reads up to size bytes from the start of the file, the buffer is shorter if the file is
+static bool readFileHeader(const std::string &filename, std::vector<unsigned char> &buffer, size_t size) {
+    FILE *f = openFile(filename, "rb");
+    if (!f)
+        return false;
+    buffer.resize(size);
+    buffer.resize(fread(buffer.data(), 1, size, f));
+    int error = errno;
+    fclose(f);
+    errno = error;
+    return true;
 }
 #endif
 
-template<typename T>
-static void writeImageHelper(const VSFrame *frame, const VSFrame *alphaFrame, bool isGray, Magick::Image &image, int width, int height, int bitsPerSample, const VSAPI *vsapi) {
-    unsigned prepeat = (MAGICKCORE_QUANTUM_DEPTH - 1) / bitsPerSample;
-    unsigned pleftover = MAGICKCORE_QUANTUM_DEPTH - (bitsPerSample * prepeat);
-    unsigned shiftFactor = bitsPerSample - pleftover;
-    unsigned scaleFactor = 0;
-    for (unsigned i = 0; i < prepeat; i++) {
-        scaleFactor <<= bitsPerSample;
-        scaleFactor += 1;
+#if defined(IMWRI_HAS_TURBOJPEG)
+// JPEG images are encoded and decoded with libjpeg-turbo directly when possible, which avoids ImageMagick's
+// float pixel cache and lets YUV clips be compressed without a round trip through RGB. The handles can't
+// be shared between threads so every thread creates its own when first needed.
+class TurboJPEGHandle {
+    tjhandle handle;
+public:
+    explicit TurboJPEGHandle(bool compress) : handle(compress ? tjInitCompress() : tjInitDecompress()) {
+        if (!handle)
+            throw Magick::ErrorResourceLimit("Failed to initialize libjpeg-turbo");
     }
-    scaleFactor <<= pleftover;
 
-    // basic downsampling support
-    if(bitsPerSample > MAGICKCORE_QUANTUM_DEPTH)
-        shiftFactor = bitsPerSample - MAGICKCORE_QUANTUM_DEPTH;
-
-    Magick::Pixels pixelCache(image);
+    ~TurboJPEGHandle() {
+        tjDestroy(handle);
+    }
 
-    const T * VS_RESTRICT r = reinterpret_cast<const T *>(vsapi->getReadPtr(frame, 0));
-    const T * VS_RESTRICT g = reinterpret_cast<const T *>(vsapi->getReadPtr(frame, isGray ? 0 : 1));
-    const T * VS_RESTRICT b = reinterpret_cast<const T *>(vsapi->getReadPtr(frame, isGray ? 0 : 2));
-    ptrdiff_t strideR = vsapi->getStride(frame, 0);
-    ptrdiff_t strideG = vsapi->getStride(frame, isGray ? 0 : 1);
-    ptrdiff_t strideB = vsapi->getStride(frame, isGray ? 0 : 2);
-    ssize_t rOff = pixelCache.offset(MagickCore::RedPixelChannel);
-    ssize_t gOff = pixelCache.offset(MagickCore::GreenPixelChannel);
-    ssize_t bOff = pixelCache.offset(MagickCore::BluePixelChannel);
-    size_t channels = image.channels();
+    TurboJPEGHandle(const TurboJPEGHandle &) = delete;
+    TurboJPEGHandle &operator=(const TurboJPEGHandle &) = delete;
 
-    if (alphaFrame) {
-        ssize_t aOff = pixelCache.offset(MagickCore::AlphaPixelChannel);
-        ptrdiff_t strideA = vsapi->getStride(alphaFrame, 0);
-        const T * VS_RESTRICT a = reinterpret_cast<const T *>(vsapi->getReadPtr(alphaFrame, 0));
-
-        auto loopImage = [&](const std::function<void(MagickCore::Quantum *, int &)> &loopPixels) {
-            for (int y = 0; y < height; y++) {
-                MagickCore::Quantum *pixels = pixelCache.get(0, y, width, 1);
-                int x = 0;
-                loopPixels(pixels, x);
-                for (; x < width; x++) {
-                    pixels[x * channels + rOff] = r[x] * scaleFactor + (r[x] >> shiftFactor);
-                    pixels[x * channels + gOff] = g[x] * scaleFactor + (g[x] >> shiftFactor);
-                    pixels[x * channels + bOff] = b[x] * scaleFactor + (b[x] >> shiftFactor);
-                    pixels[x * channels + aOff] = a[x] * scaleFactor + (a[x] >> shiftFactor);
-                }
+    tjhandle get() const {
+        return handle;
+    }
 
-                r += strideR / sizeof(T);
-                g += strideG / sizeof(T);
-                b += strideB / sizeof(T);
-                a += strideA / sizeof(T);
+    // warnings, such as for a truncated file, are ignored the same way ImageMagick only warns about them
+    void check(int result) const {
+        if (result && tjGetErrorCode(handle) == TJERR_FATAL)
+            throw Magick::ErrorCoder(std::string("libjpeg-turbo: ") + tjGetErrorStr2(handle));
+    }
+};
 
-                pixelCache.sync();
-            }
-        };
-#ifdef HAVE_SSE2
-        if (sizeof(MagickCore::Quantum) <= 4 && MAGICKCORE_QUANTUM_DEPTH <= 32 && channels == 4 && rOff == 0 && gOff == 1 && bOff == 2 && aOff == 3) { // typical ImageMagick config
-            if (sizeof(T) == 1 && bitsPerSample == 8) {
-                loopImage([&](MagickCore::Quantum *pixels, int &x) {
-                    for (; x < width - 15; x += 16) {
-                        __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x));
-                        __m128i g0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x));
-                        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
-                        __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + x));
-
-                        // interleave
-                        __m128i rg0 = _mm_unpacklo_epi8(r0, g0);
-                        __m128i rg1 = _mm_unpackhi_epi8(r0, g0);
-                        __m128i ba0 = _mm_unpacklo_epi8(b0, a0);
-                        __m128i ba1 = _mm_unpackhi_epi8(b0, a0);
-
-                        __m128i rgba0 = _mm_unpacklo_epi16(rg0, ba0);
-                        __m128i rgba1 = _mm_unpackhi_epi16(rg0, ba0);
-                        __m128i rgba2 = _mm_unpacklo_epi16(rg1, ba1);
-                        __m128i rgba3 = _mm_unpackhi_epi16(rg1, ba1);
-
-                        sseWritePixels8(pixels + x * channels, (const __m128i[4]){
-                            rgba0, rgba1, rgba2, rgba3
-                        });
-                    }
-                });
-                return;
-            } else if (sizeof(T) == 2 && bitsPerSample >= 8 && (MAGICKCORE_QUANTUM_DEPTH <= 16 || bitsPerSample == 8 || bitsPerSample == 16)) { // TODO: consider supporting proper upsampling to 32-bit
-                loopImage([&](MagickCore::Quantum *pixels, int &x) {
-                    __m128i shl = _mm_set_epi32(0, bitsPerSample * 2 - 16, 0, 16 - bitsPerSample);
-                    __m128i shr = _mm_unpackhi_epi64(shl, shl);
-                    for (; x < width - 7; x += 8) {
-                        __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x));
-                        __m128i g0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x));
-                        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
-                        __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + x));
-
-                        // upsample pixels to 16-bit
-                        r0 = _mm_or_si128(_mm_sll_epi16(r0, shl), _mm_srl_epi16(r0, shr));
-                        g0 = _mm_or_si128(_mm_sll_epi16(g0, shl), _mm_srl_epi16(g0, shr));
-                        b0 = _mm_or_si128(_mm_sll_epi16(b0, shl), _mm_srl_epi16(b0, shr));
-                        a0 = _mm_or_si128(_mm_sll_epi16(a0, shl), _mm_srl_epi16(a0, shr));
-
-                        // interleave
-                        __m128i rg0 = _mm_unpacklo_epi16(r0, g0);
-                        __m128i rg1 = _mm_unpackhi_epi16(r0, g0);
-                        __m128i ba0 = _mm_unpacklo_epi16(b0, a0);
-                        __m128i ba1 = _mm_unpackhi_epi16(b0, a0);
-
-                        sseWritePixels16(pixels + x * channels, (const __m128i[4]){
-                            _mm_unpacklo_epi32(rg0, ba0),
-                            _mm_unpackhi_epi32(rg0, ba0),
-                            _mm_unpacklo_epi32(rg1, ba1),
-                            _mm_unpackhi_epi32(rg1, ba1)
-                        });
-                    }
-                });
-                return;
-            }
-        }
 #endif
-        loopImage([&](MagickCore::Quantum *pixels, int &x) {});
-    } else {
-        auto loopImage = [&](const std::function<void(MagickCore::Quantum *, int &)> &loopPixels) {
-            for (int y = 0; y < height; y++) {
-                MagickCore::Quantum *pixels = pixelCache.get(0, y, width, 1);
-                int x = 0;
-                loopPixels(pixels, x);
-                for (; x < width; x++) {
-                    pixels[x * channels + rOff] = r[x] * scaleFactor + (r[x] >> shiftFactor);
-                    pixels[x * channels + gOff] = g[x] * scaleFactor + (g[x] >> shiftFactor);
-                    pixels[x * channels + bOff] = b[x] * scaleFactor + (b[x] >> shiftFactor);
-                }
 
-                r += strideR / sizeof(T);
-                g += strideG / sizeof(T);
-                b += strideB / sizeof(T);
+static std::string upperCase(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), toupper);
+    return s;
+}
 
-                pixelCache.sync();
-            }
-        };
+#if defined(IMWRI_HAS_OPENEXR)
+// OpenEXR files are read and written with the OpenEXR library directly, the pixels go straight between
+// VapourSynth's planes and the library which also compresses and decompresses blocks of scanlines on
+// its own thread pool. Half floats are converted by Imath which uses F16C when it's available.
 
-#ifdef HAVE_SSE2
-        if (sizeof(MagickCore::Quantum) <= 4 && MAGICKCORE_QUANTUM_DEPTH <= 32 && channels == 3 && rOff == 0 && gOff == 1 && bOff == 2) { // typical ImageMagick config
-            if (sizeof(T) == 1 && bitsPerSample == 8) {
-                loopImage([&](MagickCore::Quantum *pixels, int &x) {
-                    for (; x < width - 31; x += 32) {
-                        __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x));
-                        __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x) + 1);
-                        __m128i g0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x));
-                        __m128i g1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x) + 1);
-                        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
-                        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x) + 1);
-
-                        // interleave pixels via repeated packing
-                        __m128i r01a, r01b, g01a, g01b, b01a, b01b;
-                        ssePackPair8(r01a, r01b, r0, r1);
-                        ssePackPair8(g01a, g01b, g0, g1);
-                        ssePackPair8(b01a, b01b, b0, b1);
-
-                        __m128i rg0, rg2, gb1, gb3, br0, br2;
-                        ssePackPair8(rg0, rg2, r01a, g01a);
-                        ssePackPair8(gb1, gb3, g01b, b01b);
-                        ssePackPair8(br0, br2, b01a, r01b);
-
-                        __m128i rgbr0, rgbr1, gbrg0, gbrg1, brgb0, brgb1;
-                        ssePackPair8(rgbr0, rgbr1, rg0, br0);
-                        ssePackPair8(gbrg0, gbrg1, gb1, rg2);
-                        ssePackPair8(brgb0, brgb1, br2, gb3);
-
-                        __m128i r_g0, r_g1, b_r0, b_r1, g_b0, g_b1;
-                        ssePackPair8(r_g0, r_g1, rgbr0, gbrg0);
-                        ssePackPair8(b_r0, b_r1, brgb0, rgbr1);
-                        ssePackPair8(g_b0, g_b1, gbrg1, brgb1);
-
-                        __m128i r_r0, r_r1, g_g0, g_g1, b_b0, b_b1;
-                        ssePackPair8(r_r0, r_r1, r_g0, b_r0);
-                        ssePackPair8(g_g0, g_g1, g_b0, r_g1);
-                        ssePackPair8(b_b0, b_b1, b_r1, g_b1);
-
-                        sseWritePixels8(pixels + x * channels, (const __m128i[6]){
-                            r_r0, g_g0, b_b0,
-                            r_r1, g_g1, b_b1
-                        });
-                    }
-                });
-                return;
-            } else if (sizeof(T) == 2 && bitsPerSample >= 8 && (MAGICKCORE_QUANTUM_DEPTH <= 16 || bitsPerSample == 8 || bitsPerSample == 16)) {
-                loopImage([&](MagickCore::Quantum *pixels, int &x) {
-                    __m128i shl = _mm_set_epi32(0, bitsPerSample * 2 - 16, 0, 16 - bitsPerSample);
-                    __m128i shr = _mm_unpackhi_epi64(shl, shl);
-                    for (; x < width - 15; x += 16) {
-                        __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x));
-                        __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x) + 1);
-                        __m128i g0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x));
-                        __m128i g1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x) + 1);
-                        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x));
-                        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x) + 1);
-
-                        // upsample pixels to 16-bit
-                        r0 = _mm_or_si128(_mm_sll_epi16(r0, shl), _mm_srl_epi16(r0, shr));
-                        r1 = _mm_or_si128(_mm_sll_epi16(r1, shl), _mm_srl_epi16(r1, shr));
-                        g0 = _mm_or_si128(_mm_sll_epi16(g0, shl), _mm_srl_epi16(g0, shr));
-                        g1 = _mm_or_si128(_mm_sll_epi16(g1, shl), _mm_srl_epi16(g1, shr));
-                        b0 = _mm_or_si128(_mm_sll_epi16(b0, shl), _mm_srl_epi16(b0, shr));
-                        b1 = _mm_or_si128(_mm_sll_epi16(b1, shl), _mm_srl_epi16(b1, shr));
-
-                        // interleave pixels via repeated packing
-                        __m128i r01a, r01b, g01a, g01b, b01a, b01b;
-                        ssePackPair16(r01a, r01b, r0, r1);
-                        ssePackPair16(g01a, g01b, g0, g1);
-                        ssePackPair16(b01a, b01b, b0, b1);
-
-                        __m128i rg0, rg2, gb1, gb3, br0, br2;
-                        ssePackPair16(rg0, rg2, r01a, g01a);
-                        ssePackPair16(gb1, gb3, g01b, b01b);
-                        ssePackPair16(br0, br2, b01a, r01b);
-
-                        __m128i rgbr0, rgbr1, gbrg0, gbrg1, brgb0, brgb1;
-                        ssePackPair16(rgbr0, rgbr1, rg0, br0);
-                        ssePackPair16(gbrg0, gbrg1, gb1, rg2);
-                        ssePackPair16(brgb0, brgb1, br2, gb3);
-
-                        __m128i r_g0, r_g1, b_r0, b_r1, g_b0, g_b1;
-                        ssePackPair16(r_g0, r_g1, rgbr0, gbrg0);
-                        ssePackPair16(b_r0, b_r1, brgb0, rgbr1);
-                        ssePackPair16(g_b0, g_b1, gbrg1, brgb1);
-
-                        sseWritePixels16(pixels + x * channels, (const __m128i[6]){
-                            r_g0, b_r0, g_b0,
-                            r_g1, b_r1, g_b1
-                        });
-                    }
-                });
-                return;
-            }
-        }
+#if OPENEXR_VERSION_MAJOR >= 3
+typedef uint64_t EXROffset;
+#else
+typedef Imf::Int64 EXROffset;
 #endif
-        loopImage([&](MagickCore::Quantum *pixels, int &x) {});
-    }
+
+// The pool only ever grows since files that are being read or written keep using it
+static void reserveEXRThreads(int threads) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (threads > 1 && Imf::globalThreadCount() < threads)
+        Imf::setGlobalThreadCount(threads);
 }
 
-// for the WriteData argument, only `imgFormat`, `compressType`, `dither` and `quality` fields are referenced
-static Magick::Image frameToImage(const VSFrame *frame, const VSFrame *alphaFrame, const WriteData *d, const VSAPI *vsapi) {
-    const VSVideoFormat *fi = vsapi->getVideoFrameFormat(frame);
-    int width = vsapi->getFrameWidth(frame, 0);
-    int height = vsapi->getFrameHeight(frame, 0);
+class MemoryIStream : public Imf::IStream {
+    const char *data;
+    size_t length;
+    size_t position = 0;
+public:
+    MemoryIStream(const void *data, size_t length) : Imf::IStream("memory"), data(static_cast<const char *>(data)), length(length) {}
 
-    Magick::Image image(Magick::Geometry(width, height), Magick::Color(0, 0, 0, 0));
-    image.magick(d->imgFormat);
-    image.modulusDepth(fi->bitsPerSample);
-    if (d->compressType != MagickCore::UndefinedCompression)
-        image.compressType(d->compressType);
-    image.quantizeDitherMethod(Magick::FloydSteinbergDitherMethod);
-    image.quantizeDither(d->dither);
-    image.quality(d->quality);
-    image.alphaChannel(alphaFrame ? Magick::ActivateAlphaChannel : Magick::RemoveAlphaChannel);
+    bool isMemoryMapped() const override {
+        return true;
+    }
 
-    bool isGray = fi->colorFamily == cfGray;
-    if (isGray)
-        image.colorSpace(Magick::GRAYColorspace);
+    char *readMemoryMapped(int n) override {
+        if (n < 0 || length - position < static_cast<size_t>(n))
+            throw std::runtime_error("Unexpected end of file");
+        char *result = const_cast<char *>(data + position);
+        position += n;
+        return result;
+    }
 
-    if (fi->bytesPerSample == 4 && fi->sampleType == stFloat) {
-        image.attribute("quantum:format", "floating-point");
-        Magick::Pixels pixelCache(image);
-        const Quantum scaleFactor = QuantumRange;
-
-        const float * VS_RESTRICT r = reinterpret_cast<const float *>(vsapi->getReadPtr(frame, 0));
-        const float * VS_RESTRICT g = reinterpret_cast<const float *>(vsapi->getReadPtr(frame, isGray ? 0 : 1));
-        const float * VS_RESTRICT b = reinterpret_cast<const float *>(vsapi->getReadPtr(frame, isGray ? 0 : 2));
-       
-        ptrdiff_t strideR = vsapi->getStride(frame, 0);
-        ptrdiff_t strideG = vsapi->getStride(frame, isGray ? 0 : 1);
-        ptrdiff_t strideB = vsapi->getStride(frame, isGray ? 0 : 2);
-            
-        ssize_t rOff = pixelCache.offset(MagickCore::RedPixelChannel);
-        ssize_t gOff = pixelCache.offset(MagickCore::GreenPixelChannel);
-        ssize_t bOff = pixelCache.offset(MagickCore::BluePixelChannel);
-        size_t channels = image.channels();
-
-        if (alphaFrame) {
-            const float * VS_RESTRICT a = reinterpret_cast<const float *>(vsapi->getReadPtr(alphaFrame, 0));
-            ptrdiff_t strideA = vsapi->getStride(alphaFrame, 0);
-            ssize_t aOff = pixelCache.offset(MagickCore::AlphaPixelChannel);
-    
-            for (int y = 0; y < height; y++) {
-                MagickCore::Quantum* pixels = pixelCache.get(0, y, width, 1);
-                for (int x = 0; x < width; x++) {
-                    pixels[x * channels + rOff] = r[x] * scaleFactor;
-                    pixels[x * channels + gOff] = g[x] * scaleFactor;
-                    pixels[x * channels + bOff] = b[x] * scaleFactor;
-                    pixels[x * channels + aOff] = a[x] * scaleFactor;
-                }
+    bool read(char c[], int n) override {
+        memcpy(c, readMemoryMapped(n), n);
+        return position < length;
+    }
 
-                r += strideR / sizeof(float);
-                g += strideG / sizeof(float);
-                b += strideB / sizeof(float);
-                a += strideA / sizeof(float);
+    EXROffset tellg() override {
+        return position;
+    }
 
-                pixelCache.sync();
-            }
-        } else {
-            const float *r = reinterpret_cast<const float *>(vsapi->getReadPtr(frame, 0));
-            const float *g = reinterpret_cast<const float *>(vsapi->getReadPtr(frame, isGray ? 0 : 1));
-            const float *b = reinterpret_cast<const float *>(vsapi->getReadPtr(frame, isGray ? 0 : 2));
-
-            for (int y = 0; y < height; y++) {
-                MagickCore::Quantum* pixels = pixelCache.get(0, y, width, 1);
-                for (int x = 0; x < width; x++) {
-                    pixels[x * channels + rOff] = r[x] * scaleFactor;
-                    pixels[x * channels + gOff] = g[x] * scaleFactor;
-                    pixels[x * channels + bOff] = b[x] * scaleFactor;
-                }
+    void seekg(EXROffset pos) override {
+        position = static_cast<size_t>(std::min<EXROffset>(pos, length));
+    }
+};
 
-                r += strideR / sizeof(float);
-                g += strideG / sizeof(float);
-                b += strideB / sizeof(float);
+static bool isEXR(const unsigned char *data, size_t length) {
+    return length >= 4 && data[0] == 0x76 && data[1] == 0x2F && data[2] == 0x31 && data[3] == 0x01;
+}
+#endif
 
-                pixelCache.sync();
+// Worker threads that live as long as the filter owning them, so work that's split up within a frame neither
+// starts threads every time nor loses thread_local state such as codec handles. The calling thread always
+// takes part and never waits for work that hasn't started yet, which makes it safe to use the same pool from
+// several frames at once and from within its own jobs.
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+
+    void run() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
             }
+            job();
+        }
+    }
+public:
+    explicit ThreadPool(int numWorkers) : stopping(false) {
+        for (int i = 0; i < numWorkers; i++)
+            workers.emplace_back([this]() { run(); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
         }
-    } else if (fi->bytesPerSample == 4) {
-        writeImageHelper<uint32_t>(frame, alphaFrame, isGray, image, width, height, fi->bitsPerSample, vsapi);
-    } else if (fi->bytesPerSample == 2) {
-        writeImageHelper<uint16_t>(frame, alphaFrame, isGray, image, width, height, fi->bitsPerSample, vsapi);
-    } else if (fi->bytesPerSample == 1) {
-        writeImageHelper<uint8_t>(frame, alphaFrame, isGray, image, width, height, fi->bitsPerSample, vsapi);
+        wake.notify_all();
+        for (auto &t : workers)
+            t.join();
     }
 
-    return image;
+    int size() const {
+        return static_cast<int>(workers.size());
+    }
+
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        wake.notify_one();
+    }
+};
+
+// Runs func for every index from 0 to count - 1 on up to threads threads, the calling thread included. The
+// other threads come from pool, everything runs on the calling thread when it's null or has no workers.
+static void parallelFor(ThreadPool *pool, int count, int threads, const std::function<void(int)> &func) {
+    // helpers that only get to run after everything is done must not touch func anymore
+    struct Batch {
+        std::atomic<int> next;
+        std::mutex mutex;
+        std::condition_variable done;
+        int active;
+        bool closed;
+    };
+    auto batch = std::make_shared<Batch>();
+    batch->next = 0;
+    batch->active = 0;
+    batch->closed = false;
+    const std::function<void(int)> *f = &func;
+    auto work = [batch, count, f]() {
+        for (int i = batch->next++; i < count; i = batch->next++)
+            (*f)(i);
+    };
+
+    int helpers = pool ? std::min(std::min(count, threads) - 1, pool->size()) : 0;
+    for (int i = 0; i < helpers; i++) {
+        pool->submit([batch, work]() {
+            {
+                std::lock_guard<std::mutex> lock(batch->mutex);
+                if (batch->closed)
+                    return;
+                batch->active++;
+            }
+            work();
+            std::lock_guard<std::mutex> lock(batch->mutex);
+            if (!--batch->active)
+                batch->done.notify_all();
+        });
+    }
+    work();
+
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->closed = true;
+    batch->done.wait(lock, [&]() { return !batch->active; });
 }
 
-static inline bool frameDimsMatch(const VSFrame *a, const VSFrame *b, const VSAPI *vsapi) {
-    return vsapi->getFrameWidth(a, 0) == vsapi->getFrameWidth(b, 0) &&
-           vsapi->getFrameHeight(b, 0) == vsapi->getFrameHeight(b, 0);
+// Returns the size an image is reduced to, either by an integer factor or so that neither dimension exceeds maxSize
+static void scaledSize(int width, int height, int scale, int maxSize, int &scaledWidth, int &scaledHeight) {
+    scaledWidth = (width + scale - 1) / scale;
+    scaledHeight = (height + scale - 1) / scale;
+    int largest = std::max(scaledWidth, scaledHeight);
+    if (maxSize && largest > maxSize) {
+        scaledWidth = std::max(1, static_cast<int>(static_cast<int64_t>(scaledWidth) * maxSize / largest));
+        scaledHeight = std::max(1, static_cast<int>(static_cast<int64_t>(scaledHeight) * maxSize / largest));
+    }
 }
 
-static const VSFrame *VS_CC writeGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
-    WriteData *d = static_cast<WriteData *>(instanceData);
+//////////////////////////////////////////
+// Statistics
+
+enum Phase {
+    phReadFile,
+    phDecode,
+    phReadConvert,
+    phWriteConvert,
+    phEncode,
+    phWriteFile,
+    phNumPhases
+};
 
-    if (activationReason == arInitial) {
-        vsapi->requestFrameFilter(n, d->videoNode, frameCtx);
-        if (d->alphaNode)
-            vsapi->requestFrameFilter(n, d->alphaNode, frameCtx);
-    } else if (activationReason == arAllFramesReady) {
-        const VSFrame *frame = vsapi->getFrameFilter(n, d->videoNode, frameCtx);
-        const VSFrame *alphaFrame = nullptr;
+static const char *phaseNames[phNumPhases] = { "read", "decode", "read_convert", "write_convert", "encode", "write" };
 
-        std::string filename = specialPrintf(d->filename, n + d->firstNum);
-        if (!isAbsolute(filename))
-            filename = d->workingDir + filename;
+// Aggregate counters for all instances. Histogram bucket i counts the calls that took less than 2^i microseconds
+// but at least half that, the last bucket also counts everything slower.
+struct PhaseStats {
+    static constexpr int numBuckets = 25;
+    std::atomic<int64_t> count;
+    std::atomic<int64_t> totalNs;
+    std::atomic<int64_t> bytes;
+    std::atomic<int64_t> histogram[numBuckets];
+};
 
-        if (!d->overwrite && fileExists(filename))
-            return frame;
+static PhaseStats phaseStats[phNumPhases];
 
-        if (d->alphaNode) {
-            alphaFrame = vsapi->getFrameFilter(n, d->alphaNode, frameCtx);
+// Per-frame timings, durations are in nanoseconds and bytes is the size of the encoded image.
+// The frame number is only used to tag trace events, -1 means there is none.
+struct FrameTimings {
+    int64_t ns[phNumPhases] = {};
+    int64_t bytes = 0;
+    int frame = -1;
+};
 
-            if (!frameDimsMatch(frame, alphaFrame, vsapi)) {
-                vsapi->setFilterError("Write: Mismatched dimension of the alpha clip", frameCtx);
-                vsapi->freeFrame(frame);
-                vsapi->freeFrame(alphaFrame);
-                return nullptr;
-            }
-        }
+static void recordPhase(Phase phase, int64_t ns, int64_t bytes) {
+    PhaseStats &stats = phaseStats[phase];
+    stats.count.fetch_add(1, std::memory_order_relaxed);
+    stats.totalNs.fetch_add(ns, std::memory_order_relaxed);
+    stats.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    int bucket = 0;
+    for (int64_t us = ns / 1000; us > 0 && bucket < PhaseStats::numBuckets - 1; us >>= 1)
+        bucket++;
+    stats.histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+}
 
-        try {
-            auto image = frameToImage(frame, alphaFrame, d, vsapi);
-            image.strip();
-            image.write(filename);
+// Every phase can also be logged as a complete event in the Chrome trace event format, viewable in
+// chrome://tracing or Perfetto. Each thread appends to its own buffer so the only cost while tracing
+// is an uncontended lock, the events are formatted when the trace is written.
 
-            vsapi->freeFrame(alphaFrame);
-            return frame;
-        } catch (Magick::Exception &e) {
-            vsapi->setFilterError((std::string("Write: ImageMagick error: ") + e.what()).c_str(), frameCtx);
-            vsapi->freeFrame(frame);
-            vsapi->freeFrame(alphaFrame);
-            return nullptr;
-        }
-    }
+struct TraceEvent {
+    Phase phase;
+    int frame;
+    int64_t start; // ns since the trace was started
+    int64_t duration;
+};
 
-    return nullptr;
+struct ThreadTrace {
+    int tid;
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+};
+
+static std::atomic<bool> tracing(false);
+static std::mutex traceMutex;
+static std::string traceFilename;
+static std::chrono::steady_clock::time_point traceStart;
+static std::vector<std::shared_ptr<ThreadTrace>> traceThreads;
+
+static ThreadTrace &threadTrace() {
+    // shared with traceThreads so the events outlive threads that exit before the trace is written
+    static thread_local std::shared_ptr<ThreadTrace> buffer;
+    if (!buffer) {
+        buffer = std::make_shared<ThreadTrace>();
+        std::lock_guard<std::mutex> lock(traceMutex);
+        buffer->tid = static_cast<int>(traceThreads.size()) + 1;
+        traceThreads.push_back(buffer);
+    }
+    return *buffer;
 }
 
-static void VS_CC writeFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
-    WriteData *d = static_cast<WriteData *>(instanceData);
-    vsapi->freeNode(d->videoNode);
-    vsapi->freeNode(d->alphaNode);
-    delete d;
+static void traceEvent(Phase phase, int frame, std::chrono::steady_clock::time_point start, int64_t duration) {
+    ThreadTrace &buffer = threadTrace();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    // checked again under the lock so no events are added after the trace has been written
+    if (!tracing)
+        return;
+    buffer.events.push_back({ phase, frame, std::chrono::duration_cast<std::chrono::nanoseconds>(start - traceStart).count(), duration });
 }
 
-static const char* fillWriteDataFromMap(const VSMap *in, std::unique_ptr<WriteData> &d, const VSAPI *vsapi) {
-    int err = 0;
-    d->quality = vsapi->mapGetIntSaturated(in, "quality", 0, &err);
-    if (err)
-        d->quality = 75;
-    if (d->quality < 0 || d->quality > 100)
-        return "Quality must be between 0 and 100";
+// Writes and discards the collected events, traceMutex must be held
+static bool writeTrace(std::string &error) {
+    std::string filename;
+    filename.swap(traceFilename);
+
+    FILE *f = openFile(filename, "wb");
+    if (!f)
+        error = "Failed to open " + filename + ": " + strerror(errno);
+    else
+        fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+
+    bool first = true;
+    for (auto &buffer : traceThreads) {
+        std::lock_guard<std::mutex> lock(buffer->mutex);
+        if (f) {
+            fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", first ? "" : ",\n", buffer->tid, buffer->tid);
+            first = false;
+            for (const auto &ev : buffer->events) {
+                fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"imwri\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", phaseNames[ev.phase], buffer->tid, ev.start / 1000., ev.duration / 1000.);
+                if (ev.frame >= 0)
+                    fprintf(f, ",\"args\":{\"frame\":%d}", ev.frame);
+                fputc('}', f);
+            }
+        }
+        buffer->events.clear();
+        buffer->events.shrink_to_fit();
+    }
+
+    if (!f)
+        return false;
+    fputs("\n]}\n", f);
+    bool success = !ferror(f);
+    if (fclose(f) || !success) {
+        error = "Failed to write " + filename + ": " + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+// Starts a new trace, or only stops the current one if filename is empty. Any trace in progress is written first.
+static bool setTrace(const std::string &filename, std::string &error) {
+    std::lock_guard<std::mutex> lock(traceMutex);
+    bool success = true;
+    if (tracing) {
+        for (auto &buffer : traceThreads)
+            buffer->mutex.lock();
+        tracing = false;
+        for (auto &buffer : traceThreads)
+            buffer->mutex.unlock();
+        success = writeTrace(error);
+    }
+    if (!filename.empty()) {
+        traceFilename = filename;
+        traceStart = std::chrono::steady_clock::now();
+        tracing = true;
+    }
+    return success;
+}
+
+// Makes sure a trace started with IMWRI_TRACE, or never stopped, still gets written when the plugin is unloaded
+static struct TraceFinalizer {
+    ~TraceFinalizer() {
+        std::string error;
+        if (!setTrace("", error))
+            fprintf(stderr, "IMWRI: %s\n", error.c_str());
+    }
+} traceFinalizer;
+
+static void VS_CC trace(const VSMap *in, VSMap *out, void *, VSCore *core, const VSAPI *vsapi) {
+    int err = 0;
+    const char *filename = vsapi->mapGetData(in, "filename", 0, &err);
+    std::string error;
+    if (!setTrace(err ? "" : filename, error))
+        vsapi->mapSetError(out, ("Trace: " + error).c_str());
+}
+
+// Times a phase from construction until stop() or destruction and adds it to both the frame's timings and the aggregate counters
+class PhaseTimer {
+    FrameTimings &timings;
+    Phase phase;
+    std::chrono::steady_clock::time_point start;
+    int64_t bytes;
+    bool running;
+public:
+    PhaseTimer(FrameTimings &timings, Phase phase) : timings(timings), phase(phase), start(std::chrono::steady_clock::now()), bytes(0), running(true) {}
+
+    void setBytes(int64_t count) {
+        bytes = count;
+    }
+
+    void stop() {
+        if (!running)
+            return;
+        running = false;
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        timings.ns[phase] += ns;
+        timings.bytes = std::max(timings.bytes, bytes);
+        recordPhase(phase, ns, bytes);
+        if (tracing.load(std::memory_order_relaxed))
+            traceEvent(phase, timings.frame, start, ns);
+    }
+
+    ~PhaseTimer() {
+        stop();
+    }
+};
+
+static void setTimingProps(VSMap *props, const FrameTimings &timings, const VSAPI *vsapi) {
+    static const char *propNames[phNumPhases] = { "_IMWRIReadNs", "_IMWRIDecodeNs", "_IMWRIConvertNs", "_IMWRIConvertNs", "_IMWRIEncodeNs", "_IMWRIWriteNs" };
+    for (int i = 0; i < phNumPhases; i++)
+        if (timings.ns[i])
+            vsapi->mapSetInt(props, propNames[i], timings.ns[i], maReplace);
+    vsapi->mapSetInt(props, "_IMWRIBytes", timings.bytes, maReplace);
+}
+
+static void VS_CC stats(const VSMap *in, VSMap *out, void *, VSCore *core, const VSAPI *vsapi) {
+    int err = 0;
+    bool reset = !!vsapi->mapGetInt(in, "reset", 0, &err);
+
+    for (int i = 0; i < phNumPhases; i++) {
+        PhaseStats &stats = phaseStats[i];
+        std::string name = phaseNames[i];
+        int64_t histogram[PhaseStats::numBuckets];
+        if (reset) {
+            vsapi->mapSetInt(out, (name + "_count").c_str(), stats.count.exchange(0), maReplace);
+            vsapi->mapSetInt(out, (name + "_ns").c_str(), stats.totalNs.exchange(0), maReplace);
+            vsapi->mapSetInt(out, (name + "_bytes").c_str(), stats.bytes.exchange(0), maReplace);
+            for (int j = 0; j < PhaseStats::numBuckets; j++)
+                histogram[j] = stats.histogram[j].exchange(0);
+        } else {
+            vsapi->mapSetInt(out, (name + "_count").c_str(), stats.count, maReplace);
+            vsapi->mapSetInt(out, (name + "_ns").c_str(), stats.totalNs, maReplace);
+            vsapi->mapSetInt(out, (name + "_bytes").c_str(), stats.bytes, maReplace);
+            for (int j = 0; j < PhaseStats::numBuckets; j++)
+                histogram[j] = stats.histogram[j];
+        }
+        vsapi->mapSetIntArray(out, (name + "_histogram").c_str(), histogram, PhaseStats::numBuckets);
+    }
+}
+
+//////////////////////////////////////////
+// Write
+
+// One output of Write or EncodeFrame. Every frame is converted once and then encoded for each target.
+struct WriteTarget {
+    std::string imgFormat;
+    std::string filename;
+    int quality;
+    MagickCore::CompressionType compressType;
+    int compressionLevel; // -1 when not set
+    int exrCompression; // compression types only the native EXR encoder has, -1 when not set
+    // reduced size output, a scale of 1 and maxSize of 0 mean full size
+    int scale;
+    int maxSize;
+    // IMWRI's own encoders are used instead of ImageMagick for the most common formats when possible
+    enum NativeEncoder {
+        neNone,
+        neJPEG,
+        nePNG,
+        neEXR
+    } nativeEncoder;
+
+    WriteTarget() : quality(75), compressType(MagickCore::UndefinedCompression), compressionLevel(-1), exrCompression(-1), scale(1), maxSize(0), nativeEncoder(neNone) {}
+};
+
+struct WriteData {
+    VSNode *videoNode;
+    VSNode *alphaNode;
+    const VSVideoInfo *vi;
+    std::vector<WriteTarget> targets;
+    // further clips stored in the same file, as channels prefixed with the name in EXR and as extra images otherwise
+    std::vector<VSNode *> layerNodes;
+    std::vector<std::string> layerNames;
+    std::string workingDir;
+    std::string tempSuffix; // appended to the filename while a file is written, unique to the instance
+    int firstNum;
+    bool dither;
+    bool overwrite;
+    // stream mode, all frames are written in order to fd instead of to separate files
+    int fd;
+    int nextFrame;
+    std::map<int, std::vector<unsigned char>> pendingFrames;
+    int streamWindow; // how far ahead of nextFrame a frame may finish before it's an error
+    int failedFrame; // the first frame that couldn't be written, nothing after it can be, -1 when none
+    std::mutex streamMutex;
+    // files are flushed to disk in batches of this size, 0 means never
+    int syncInterval;
+    std::vector<std::pair<std::string, uint64_t>> unsyncedFiles; // filename and checksum
+    std::mutex syncMutex;
+    // resume mode, a log of completed files that lets existing files be trusted without reading them
+    struct ManifestEntry {
+        uint64_t size;
+        int64_t mtime;
+        uint64_t checksum;
+    };
+    FILE *manifest;
+    std::string manifestName;
+    std::unordered_map<std::string, ManifestEntry> manifestEntries;
+    std::mutex manifestMutex;
+    // dedupe mode, the first files written for each frame hash, one per target, frames with the same hash are linked to them
+    struct DedupeEntry {
+        std::string filename;
+        uint64_t checksum;
+    };
+    bool dedupe;
+    std::unordered_map<uint64_t, std::vector<DedupeEntry>> dedupeFiles;
+    std::mutex dedupeMutex;
+    // the threads that targets, PNG chunks and dithering are spread over, null in EncodeFrame which runs everything on the calling thread
+    std::unique_ptr<ThreadPool> pool;
+    bool timing;
+    // frames are dithered down to this depth before they're encoded, 0 when not set
+    int depth;
+    DitherType ditherType;
+    VSVideoFormat ditheredFormat;
+    VSVideoFormat ditheredAlphaFormat;
+
+    WriteData() : videoNode(nullptr), alphaNode(nullptr), vi(nullptr), firstNum(0), dither(true), fd(-1), nextFrame(0), streamWindow(0), failedFrame(-1), syncInterval(0), manifest(nullptr), dedupe(false), timing(false), depth(0), ditherType(ditherOrdered), ditheredFormat(), ditheredAlphaFormat() {}
+};
+
+// Sets the formats that frames of format f and their alpha are dithered to, returns an error message if f can't be reduced
+static const char *setDitheredFormats(WriteData *d, const VSVideoFormat &f, VSCore *core, const VSAPI *vsapi) {
+    if (!d->depth) {
+        d->ditheredFormat = f;
+        vsapi->queryVideoFormat(&d->ditheredAlphaFormat, cfGray, f.sampleType, f.bitsPerSample, 0, 0, core);
+        return nullptr;
+    }
+    if (f.sampleType == stFloat ? f.bitsPerSample != 32 : (f.bitsPerSample > 16 || f.bitsPerSample <= d->depth))
+        return "Depth can only be reduced for 9-16 bit integer and 32 bit float input";
+    vsapi->queryVideoFormat(&d->ditheredFormat, f.colorFamily, stInteger, d->depth, f.subSamplingW, f.subSamplingH, core);
+    vsapi->queryVideoFormat(&d->ditheredAlphaFormat, cfGray, stInteger, d->depth, 0, 0, core);
+    return nullptr;
+}
+
+// Returns a copy of frame reduced to format, which has to come from setDitheredFormats(). Rows are processed
+// in bands of the dither matrix height so that every band starts at the top of the matrix.
+static VSFrame *ditherFrame(const WriteData *d, const VSFrame *frame, const VSVideoFormat &format, VSCore *core, const VSAPI *vsapi) {
+    const VSVideoFormat *fi = vsapi->getVideoFrameFormat(frame);
+    VSFrame *dst = vsapi->newVideoFrame(&format, vsapi->getFrameWidth(frame, 0), vsapi->getFrameHeight(frame, 0), frame, core);
+    bool isFloat = fi->sampleType == stFloat;
+    int shift = isFloat ? 0 : fi->bitsPerSample - format.bitsPerSample;
+    DitherMatrix matrix(d->ditherType, shift);
+
+    int bands = (vsapi->getFrameHeight(frame, 0) + ditherMatrixSize - 1) / ditherMatrixSize;
+    parallelFor(d->pool.get(), format.numPlanes * bands, getImageThreads(core, vsapi), [&](int i) {
+        int plane = i / bands;
+        int y = (i % bands) * ditherMatrixSize;
+        int height = vsapi->getFrameHeight(frame, plane);
+        if (y >= height)
+            return;
+        int rows = std::min(ditherMatrixSize, height - y);
+        int width = vsapi->getFrameWidth(frame, plane);
+        ptrdiff_t srcStride = vsapi->getStride(frame, plane);
+        ptrdiff_t dstStride = vsapi->getStride(dst, plane);
+        const uint8_t *srcp = vsapi->getReadPtr(frame, plane) + y * srcStride;
+        uint8_t *dstp = vsapi->getWritePtr(dst, plane) + y * dstStride;
+        // the planes start at different matrix rows so the channels don't all get the same pattern
+        int matrixRow = y + plane * 23;
+
+        if (isFloat && format.bytesPerSample == 1)
+            ditherRowsFloat(reinterpret_cast<const float *>(srcp), srcStride, dstp, dstStride, width, matrixRow, rows, format.bitsPerSample, matrix);
+        else if (isFloat)
+            ditherRowsFloat(reinterpret_cast<const float *>(srcp), srcStride, reinterpret_cast<uint16_t *>(dstp), dstStride, width, matrixRow, rows, format.bitsPerSample, matrix);
+        else if (format.bytesPerSample == 1)
+            ditherRows(reinterpret_cast<const uint16_t *>(srcp), srcStride, dstp, dstStride, width, matrixRow, rows, shift, format.bitsPerSample, matrix);
+        else
+            ditherRows(reinterpret_cast<const uint16_t *>(srcp), srcStride, reinterpret_cast<uint16_t *>(dstp), dstStride, width, matrixRow, rows, shift, format.bitsPerSample, matrix);
+    });
+
+    return dst;
+}
+
+// for the WriteData argument, only `imgFormat`, `compressType`, `dither`, `quality` and `compressionLevel` fields are referenced
+static Magick::Image frameToImage(const VSFrame *frame, const VSFrame *alphaFrame, const WriteData *d, const VSAPI *vsapi) {
+    const VSVideoFormat *fi = vsapi->getVideoFrameFormat(frame);
+    int width = vsapi->getFrameWidth(frame, 0);
+    int height = vsapi->getFrameHeight(frame, 0);
+
+    Magick::Image image(Magick::Geometry(width, height), Magick::Color(0, 0, 0, 0));
+    image.modulusDepth(fi->bitsPerSample);
+    image.quantizeDitherMethod(Magick::FloydSteinbergDitherMethod);
+    image.quantizeDither(d->dither);
+    image.alphaChannel(alphaFrame ? Magick::ActivateAlphaChannel : Magick::RemoveAlphaChannel);
+
+    bool isGray = fi->colorFamily == cfGray;
+    if (isGray)
+        image.colorSpace(Magick::GRAYColorspace);
+
+    if (fi->sampleType == stFloat)
+        image.attribute("quantum:format", "floating-point");
+
+    ConstPlanes src = {};
+    for (int plane = 0; plane < 3; plane++) {
+        src.ptr[plane] = vsapi->getReadPtr(frame, isGray ? 0 : plane);
+        src.stride[plane] = vsapi->getStride(frame, isGray ? 0 : plane);
+    }
+    if (alphaFrame) {
+        src.ptr[3] = vsapi->getReadPtr(alphaFrame, 0);
+        src.stride[3] = vsapi->getStride(alphaFrame, 0);
+    }
+
+    planesToImage(src, image, width, height, fi->bitsPerSample, fi->bytesPerSample, fi->sampleType == stFloat);
+
+    return image;
+}
+
+static void setTargetOptions(Magick::Image &image, const WriteTarget &t) {
+    image.magick(t.imgFormat);
+    if (t.compressType != MagickCore::UndefinedCompression)
+        image.compressType(t.compressType);
+    // ImageMagick takes the zlib level for PNG from the tens digit of the quality and the filter from the ones digit
+    if (t.compressionLevel >= 0 && upperCase(t.imgFormat) == "PNG")
+        image.quality(t.compressionLevel * 10 + t.quality % 10);
+    else
+        image.quality(t.quality);
+}
+
+// Growable buffer that encoders write into directly. Instances are meant to be reused so that
+// the allocation only has to grow to the largest encoded image once instead of for every call.
+class OutputBuffer {
+    std::unique_ptr<unsigned char[]> buffer;
+    size_t capacity = 0;
+    size_t length = 0;
+    size_t position = 0;
+
+    void reserve(size_t size) {
+        if (size <= capacity)
+            return;
+        size_t newCapacity = std::max<size_t>(std::max(size, capacity + capacity / 2), 1 << 16);
+        std::unique_ptr<unsigned char[]> newBuffer(new unsigned char[newCapacity]);
+        if (length)
+            memcpy(newBuffer.get(), buffer.get(), length);
+        buffer.swap(newBuffer);
+        capacity = newCapacity;
+    }
+public:
+    const unsigned char *data() const { return buffer.get(); }
+    size_t size() const { return length; }
+    void clear() { length = 0; position = 0; }
+
+    // Sets the size to exactly count bytes and returns the buffer, for encoders that need the space up front
+    unsigned char *resize(size_t count) {
+        reserve(count);
+        length = count;
+        position = count;
+        return buffer.get();
+    }
+
+    void write(const void *src, size_t count) {
+        reserve(position + count);
+        memcpy(buffer.get() + position, src, count);
+        position += count;
+        length = std::max(length, position);
+    }
+
+    MagickCore::MagickOffsetType seek(MagickCore::MagickOffsetType offset, int whence) {
+        MagickCore::MagickOffsetType base = 0;
+        if (whence == SEEK_CUR)
+            base = position;
+        else if (whence == SEEK_END)
+            base = length;
+        if (base + offset < 0)
+            return -1;
+        position = static_cast<size_t>(base + offset);
+        // seeking past the end and writing leaves a gap that has to read back as zeroes
+        if (position > length) {
+            reserve(position);
+            memset(buffer.get() + length, 0, position - length);
+            length = position;
+        }
+        return position;
+    }
+
+    MagickCore::MagickOffsetType tell() const { return position; }
+};
+
+// Copies of an image share its pixel cache, and the cache's per thread buffers for reading pixels are indexed
+// by the OpenMP thread number, which is 0 for all of our own threads. Copies that are encoded at the same time
+// on different threads therefore need a cache of their own, which this gives the image.
+static void unsharePixelCache(Magick::Image &image) {
+    image.modifyImage();
+    MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
+    MagickCore::SyncImagePixelCache(image.image(), exception);
+    try {
+        Magick::throwException(exception);
+    } catch (Magick::Exception &) {
+        MagickCore::DestroyExceptionInfo(exception);
+        throw;
+    }
+    MagickCore::DestroyExceptionInfo(exception);
+}
+
+// Encodes the image into buf, replacing its previous contents, without going through an intermediate blob
+// Layers are written as further images of the same file, which takes linking them into a list
+static void encodeImage(Magick::Image &image, OutputBuffer &buf, std::vector<Magick::Image> *layers = nullptr) {
+    buf.clear();
+
+    MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
+    MagickCore::CustomStreamInfo *stream = MagickCore::AcquireCustomStreamInfo(exception);
+    MagickCore::SetCustomStreamData(stream, &buf);
+    MagickCore::SetCustomStreamWriter(stream, [](unsigned char *data, const size_t count, void *user) -> ssize_t {
+        static_cast<OutputBuffer *>(user)->write(data, count);
+        return count;
+    });
+    MagickCore::SetCustomStreamSeeker(stream, [](const MagickCore::MagickOffsetType offset, const int whence, void *user) -> MagickCore::MagickOffsetType {
+        return static_cast<OutputBuffer *>(user)->seek(offset, whence);
+    });
+    MagickCore::SetCustomStreamTeller(stream, [](void *user) -> MagickCore::MagickOffsetType {
+        return static_cast<OutputBuffer *>(user)->tell();
+    });
+
+    MagickCore::Image *list = image.image();
+    if (layers && !layers->empty()) {
+        image.modifyImage();
+        list = image.image();
+        MagickCore::Image *previous = list;
+        for (auto &layer : *layers) {
+            layer.modifyImage();
+            previous->next = layer.image();
+            layer.image()->previous = previous;
+            previous = layer.image();
+        }
+    }
+
+    MagickCore::ImageInfo *info = MagickCore::CloneImageInfo(image.constImageInfo());
+    info->custom_stream = stream;
+    if (list->next)
+        MagickCore::ImagesToCustomStream(info, list, exception);
+    else
+        MagickCore::ImageToCustomStream(info, list, exception);
+    info->custom_stream = nullptr;
+    // every image is owned by its Magick::Image again
+    while (list) {
+        MagickCore::Image *next = list->next;
+        list->next = nullptr;
+        list->previous = nullptr;
+        list = next;
+    }
+    MagickCore::DestroyImageInfo(info);
+    MagickCore::DestroyCustomStreamInfo(stream);
+
+    try {
+        Magick::throwException(exception);
+    } catch (Magick::Exception &) {
+        MagickCore::DestroyExceptionInfo(exception);
+        throw;
+    }
+    MagickCore::DestroyExceptionInfo(exception);
+}
+
+#if defined(IMWRI_HAS_TURBOJPEG)
+static int jpegSubsampling(const VSVideoFormat &f) {
+    if (f.subSamplingW == 0 && f.subSamplingH == 0)
+        return TJSAMP_444;
+    else if (f.subSamplingW == 1 && f.subSamplingH == 0)
+        return TJSAMP_422;
+    else if (f.subSamplingW == 1 && f.subSamplingH == 1)
+        return TJSAMP_420;
+    else if (f.subSamplingW == 0 && f.subSamplingH == 1)
+        return TJSAMP_440;
+    return -1;
+}
+
+// Whether libjpeg-turbo can be used instead of ImageMagick, only plain 8 bit images without alpha qualify.
+// YUV is only accepted here since ImageMagick can't take it at all.
+static bool canEncodeJPEG(const WriteTarget *t, const VSVideoFormat &f, bool hasAlpha) {
+    std::string format = upperCase(t->imgFormat);
+    if ((format != "JPEG" && format != "JPG") || hasAlpha || (t->compressType != MagickCore::UndefinedCompression && t->compressType != MagickCore::JPEGCompression))
+        return false;
+    if (f.sampleType != stInteger || f.bitsPerSample != 8)
+        return false;
+    return f.colorFamily == cfRGB || f.colorFamily == cfGray || (f.colorFamily == cfYUV && jpegSubsampling(f) >= 0);
+}
+
+// YUV planes are compressed as is and every JFIF reader takes them as full range BT.601, anything else would
+// silently come out with the wrong colors. Limited range is what VapourSynth assumes when _ColorRange isn't set.
+static void checkJPEGColorimetry(const VSFrame *frame, const VSAPI *vsapi) {
+    const VSMap *props = vsapi->getFramePropertiesRO(frame);
+    int err = 0;
+    int64_t range = vsapi->mapGetInt(props, "_ColorRange", 0, &err);
+    if (err || range != VSC_RANGE_FULL)
+        throw Magick::ErrorOption("JPEG: YUV input has to be full range (_ColorRange=0), convert it to full range BT.601 or to RGB first");
+    int64_t matrix = vsapi->mapGetInt(props, "_Matrix", 0, &err);
+    if (!err && matrix != VSC_MATRIX_BT470_BG && matrix != VSC_MATRIX_ST170_M && matrix != VSC_MATRIX_UNSPECIFIED)
+        throw Magick::ErrorOption("JPEG: YUV input has to use the BT.601 matrix (_Matrix=5 or 6), convert it to BT.601 or to RGB first");
+}
+
+// RGB uses the same chroma subsampling as ImageMagick would, 4:4:4 for a quality of 90 and above and 4:2:0 otherwise
+static void encodeJPEG(const VSFrame *frame, int quality, OutputBuffer &buf, const VSAPI *vsapi) {
+    static thread_local TurboJPEGHandle handle(true);
+    static thread_local std::vector<unsigned char> interleaved;
+
+    const VSVideoFormat *fi = vsapi->getVideoFrameFormat(frame);
+    int width = vsapi->getFrameWidth(frame, 0);
+    int height = vsapi->getFrameHeight(frame, 0);
+    // 0 leaves the quality up to the encoder, ImageMagick then uses 92 so the same is used here
+    if (quality == 0)
+        quality = 92;
+
+    int subsampling;
+    if (fi->colorFamily == cfYUV) {
+        checkJPEGColorimetry(frame, vsapi);
+        subsampling = jpegSubsampling(*fi);
+    } else if (fi->colorFamily == cfGray) {
+        subsampling = TJSAMP_GRAY;
+    } else {
+        subsampling = quality >= 90 ? TJSAMP_444 : TJSAMP_420;
+    }
+
+    unsigned long size = tjBufSize(width, height, subsampling);
+    unsigned char *dst = buf.resize(size);
+
+    if (fi->colorFamily == cfYUV) {
+        const unsigned char *planes[3];
+        int strides[3];
+        for (int plane = 0; plane < 3; plane++) {
+            planes[plane] = vsapi->getReadPtr(frame, plane);
+            strides[plane] = static_cast<int>(vsapi->getStride(frame, plane));
+        }
+        handle.check(tjCompressFromYUVPlanes(handle.get(), planes, width, strides, height, subsampling, &dst, &size, quality, TJFLAG_NOREALLOC));
+    } else if (fi->colorFamily == cfGray) {
+        handle.check(tjCompress2(handle.get(), vsapi->getReadPtr(frame, 0), width, static_cast<int>(vsapi->getStride(frame, 0)), height, TJPF_GRAY, &dst, &size, subsampling, quality, TJFLAG_NOREALLOC));
+    } else {
+        interleaved.resize(static_cast<size_t>(width) * height * 3);
+        const uint8_t *r = vsapi->getReadPtr(frame, 0);
+        const uint8_t *g = vsapi->getReadPtr(frame, 1);
+        const uint8_t *b = vsapi->getReadPtr(frame, 2);
+        ptrdiff_t stride = vsapi->getStride(frame, 0);
+        for (int y = 0; y < height; y++) {
+            unsigned char *row = interleaved.data() + static_cast<size_t>(y) * width * 3;
+            for (int x = 0; x < width; x++) {
+                row[x * 3] = r[x];
+                row[x * 3 + 1] = g[x];
+                row[x * 3 + 2] = b[x];
+            }
+            r += stride;
+            g += stride;
+            b += stride;
+        }
+        handle.check(tjCompress2(handle.get(), interleaved.data(), width, width * 3, height, TJPF_RGB, &dst, &size, subsampling, quality, TJFLAG_NOREALLOC));
+    }
+
+    buf.resize(size);
+}
+#endif
+
+#if defined(IMWRI_HAS_ZLIB)
+static bool canEncodePNG(const WriteTarget *t, const VSVideoFormat &f) {
+    if (upperCase(t->imgFormat) != "PNG" || (t->compressType != MagickCore::UndefinedCompression && t->compressType != MagickCore::ZipCompression))
+        return false;
+    return f.sampleType == stInteger && (f.bitsPerSample == 8 || f.bitsPerSample == 16) && (f.colorFamily == cfRGB || f.colorFamily == cfGray);
+}
+
+// Feeds the frame's planes to the encoder in pngencoder.h, the chunks are compressed on the filter's thread pool
+static void encodePNG(const VSFrame *frame, const VSFrame *alphaFrame, int level, int filter, ThreadPool *pool, int threads, OutputBuffer &buf, const VSAPI *vsapi) {
+    const VSVideoFormat *fi = vsapi->getVideoFrameFormat(frame);
+    bool isGray = fi->colorFamily == cfGray;
+    ConstPlanes src = {};
+    for (int plane = 0; plane < 3; plane++) {
+        src.ptr[plane] = vsapi->getReadPtr(frame, isGray ? 0 : plane);
+        src.stride[plane] = vsapi->getStride(frame, isGray ? 0 : plane);
+    }
+    if (alphaFrame) {
+        src.ptr[3] = vsapi->getReadPtr(alphaFrame, 0);
+        src.stride[3] = vsapi->getStride(alphaFrame, 0);
+    }
+    encodePNGPlanes(src, vsapi->getFrameWidth(frame, 0), vsapi->getFrameHeight(frame, 0), fi->bytesPerSample, isGray, level, filter, threads,
+        [&](int count, const std::function<void(int)> &func) { parallelFor(pool, count, threads, func); }, buf);
+}
+#endif
+
+#if defined(IMWRI_HAS_OPENEXR)
+static bool canEncodeEXR(const WriteTarget *t, const VSVideoFormat &f) {
+    return upperCase(t->imgFormat) == "EXR" && f.sampleType == stFloat && (f.colorFamily == cfRGB || f.colorFamily == cfGray);
+}
+
+class OutputBufferOStream : public Imf::OStream {
+    OutputBuffer &buf;
+public:
+    explicit OutputBufferOStream(OutputBuffer &buf) : Imf::OStream("memory"), buf(buf) {}
+
+    void write(const char c[], int n) override {
+        buf.write(c, n);
+    }
+
+    EXROffset tellp() override {
+        return buf.tell();
+    }
+
+    void seekp(EXROffset pos) override {
+        buf.seek(static_cast<MagickCore::MagickOffsetType>(pos), SEEK_SET);
+    }
+};
+
+// Same defaults as ImageMagick, ZIP unless another compression type is set
+static Imf::Compression exrCompression(const WriteTarget *t) {
+    if (t->exrCompression >= 0)
+        return static_cast<Imf::Compression>(t->exrCompression);
+    switch (t->compressType) {
+    case MagickCore::NoCompression: return Imf::NO_COMPRESSION;
+    case MagickCore::RLECompression: return Imf::RLE_COMPRESSION;
+    case MagickCore::ZipSCompression: return Imf::ZIPS_COMPRESSION;
+    case MagickCore::PizCompression: return Imf::PIZ_COMPRESSION;
+    case MagickCore::Pxr24Compression: return Imf::PXR24_COMPRESSION;
+    case MagickCore::B44Compression: return Imf::B44_COMPRESSION;
+    case MagickCore::B44ACompression: return Imf::B44A_COMPRESSION;
+    default: return Imf::ZIP_COMPRESSION;
+    }
+}
+
+// Channels are stored with the frame's own sample type, so half float clips produce half float files
+// Layers become channels named layer.R, layer.G and so on next to those of the main frame, each with its own precision
+static void encodeEXR(const WriteTarget *t, const VSFrame *frame, const VSFrame *alphaFrame, const std::vector<std::string> &layerNames, const std::vector<const VSFrame *> &layerFrames, int threads, OutputBuffer &buf, const VSAPI *vsapi) {
+    int width = vsapi->getFrameWidth(frame, 0);
+    int height = vsapi->getFrameHeight(frame, 0);
+    static const char *rgbNames[] = { "R", "G", "B" };
+
+    try {
+        Imf::Header header(width, height);
+        header.compression() = exrCompression(t);
+        Imf::FrameBuffer frameBuffer;
+        auto addChannel = [&](const std::string &name, const VSFrame *src, int plane) {
+            const VSVideoFormat *fi = vsapi->getVideoFrameFormat(src);
+            Imf::PixelType type = fi->bitsPerSample == 16 ? Imf::HALF : Imf::FLOAT;
+            header.channels().insert(name.c_str(), Imf::Channel(type));
+            frameBuffer.insert(name.c_str(), Imf::Slice(type, const_cast<char *>(reinterpret_cast<const char *>(vsapi->getReadPtr(src, plane))), fi->bytesPerSample, vsapi->getStride(src, plane)));
+        };
+        auto addImage = [&](const std::string &prefix, const VSFrame *src) {
+            if (vsapi->getVideoFrameFormat(src)->colorFamily == cfGray) {
+                addChannel(prefix + "Y", src, 0);
+            } else {
+                for (int plane = 0; plane < 3; plane++)
+                    addChannel(prefix + rgbNames[plane], src, plane);
+            }
+        };
+        addImage("", frame);
+        if (alphaFrame)
+            addChannel("A", alphaFrame, 0);
+        for (size_t i = 0; i < layerFrames.size(); i++)
+            addImage(layerNames[i] + ".", layerFrames[i]);
+
+        reserveEXRThreads(threads);
+        buf.clear();
+        OutputBufferOStream stream(buf);
+        Imf::OutputFile file(stream, header, threads > 1 ? threads : 0);
+        file.setFrameBuffer(frameBuffer);
+        file.writePixels(height);
+    } catch (std::exception &e) {
+        throw Magick::ErrorCoder(std::string("OpenEXR: ") + e.what());
+    }
+}
+#endif
+
+static WriteTarget::NativeEncoder selectNativeEncoder(const WriteTarget *t, const VSVideoFormat &f, bool hasAlpha) {
+#if defined(IMWRI_HAS_TURBOJPEG)
+    if (canEncodeJPEG(t, f, hasAlpha))
+        return WriteTarget::neJPEG;
+#endif
+#if defined(IMWRI_HAS_ZLIB)
+    if (canEncodePNG(t, f))
+        return WriteTarget::nePNG;
+#endif
+#if defined(IMWRI_HAS_OPENEXR)
+    if (canEncodeEXR(t, f))
+        return WriteTarget::neEXR;
+#endif
+    return WriteTarget::neNone;
+}
+
+static void encodeNative(const WriteTarget *t, const VSFrame *frame, const VSFrame *alphaFrame, const std::vector<std::string> &layerNames, const std::vector<const VSFrame *> &layerFrames, ThreadPool *pool, OutputBuffer &buf, VSCore *core, const VSAPI *vsapi) {
+    switch (t->nativeEncoder) {
+#if defined(IMWRI_HAS_TURBOJPEG)
+    case WriteTarget::neJPEG:
+        encodeJPEG(frame, t->quality, buf, vsapi);
+        break;
+#endif
+#if defined(IMWRI_HAS_ZLIB)
+    case WriteTarget::nePNG:
+        encodePNG(frame, alphaFrame, t->compressionLevel >= 0 ? t->compressionLevel : std::min(t->quality / 10, 9), t->quality % 10, pool, getImageThreads(core, vsapi), buf, vsapi);
+        break;
+#endif
+#if defined(IMWRI_HAS_OPENEXR)
+    case WriteTarget::neEXR:
+        encodeEXR(t, frame, alphaFrame, layerNames, layerFrames, getImageThreads(core, vsapi), buf, vsapi);
+        break;
+#endif
+    default:
+        break;
+    }
+}
+
+// Picks the encoder for every target, returns an error message if one of them can't handle the format
+static const char *selectTargetEncoders(WriteData *d, const VSVideoFormat &f, bool hasAlpha) {
+    for (auto &t : d->targets) {
+        // reduced size output is resized by ImageMagick so it's also encoded by it
+        t.nativeEncoder = (t.scale > 1 || t.maxSize) ? WriteTarget::neNone : selectNativeEncoder(&t, f, hasAlpha);
+        if (t.nativeEncoder == WriteTarget::neNone && ((f.colorFamily != cfRGB && f.colorFamily != cfGray) || (f.sampleType == stFloat && f.bitsPerSample != 32)))
+            return "Only constant format 8-32 bit integer or float RGB and Grayscale input supported";
+        if (t.exrCompression >= 0 && t.nativeEncoder != WriteTarget::neEXR)
+            return "DWAA and DWAB compression are only supported for full size float EXR output";
+    }
+    return nullptr;
+}
+
+// Encodes a frame for every needed target into its buffer and then calls finish, if set, from the same thread.
+// The frame is converted to an ImageMagick image once and the targets that need one get their own copy of it,
+// each with its own pixel cache so they can be encoded at the same time. With more than one target the encodes run in parallel on the
+// filter's thread pool, on at most as many threads as set with SetResources. Returns the first error, which can
+// also come from finish, or an empty string. Layers are only allowed with a single target.
+static std::string encodeTargets(const WriteData *d, const VSFrame *frame, const VSFrame *alphaFrame, const std::vector<const VSFrame *> &layerFrames, const std::vector<bool> &needed, std::vector<OutputBuffer> &buffers, FrameTimings &timings,
+    const std::function<std::string(int, const OutputBuffer &, FrameTimings &)> &finish, VSCore *core, const VSAPI *vsapi) {
+    int numTargets = static_cast<int>(d->targets.size());
+    std::vector<std::unique_ptr<Magick::Image>> images(numTargets);
+    std::vector<Magick::Image> layerImages;
+    bool convert = false;
+    for (int i = 0; i < numTargets; i++)
+        convert = convert || (needed[i] && d->targets[i].nativeEncoder == WriteTarget::neNone);
+
+    if (convert) {
+        // Initialization is deferred to the first frame that's actually encoded by ImageMagick so scripts that
+        // only preview the clip, or resume with every file already written, don't pay for it
+        initMagick(core, vsapi);
+        PhaseTimer convertTimer(timings, phWriteConvert);
+        Magick::Image image = frameToImage(frame, alphaFrame, d, vsapi);
+        image.strip();
+        bool shared = false;
+        for (int i = 0; i < numTargets; i++) {
+            if (needed[i] && d->targets[i].nativeEncoder == WriteTarget::neNone) {
+                images[i].reset(new Magick::Image(image));
+                // the first copy keeps the converted pixels, the others are encoded in parallel with it
+                if (shared)
+                    unsharePixelCache(*images[i]);
+                shared = true;
+                setTargetOptions(*images[i], d->targets[i]);
+            }
+        }
+        for (size_t i = 0; i < layerFrames.size(); i++) {
+            layerImages.push_back(frameToImage(layerFrames[i], nullptr, d, vsapi));
+            layerImages.back().strip();
+            layerImages.back().label(d->layerNames[i]);
+            setTargetOptions(layerImages.back(), d->targets[0]);
+        }
+    }
+
+    std::vector<FrameTimings> targetTimings(numTargets);
+    std::vector<std::string> errors(numTargets);
+    parallelFor(d->pool.get(), numTargets, getImageThreads(core, vsapi), [&](int i) {
+        if (!needed[i])
+            return;
+        const WriteTarget &t = d->targets[i];
+        OutputBuffer &buf = buffers[i];
+        FrameTimings &tt = targetTimings[i];
+        tt.frame = timings.frame;
+        try {
+            if (t.nativeEncoder != WriteTarget::neNone) {
+                PhaseTimer encodeTimer(tt, phEncode);
+                encodeNative(&t, frame, alphaFrame, d->layerNames, layerFrames, d->pool.get(), buf, core, vsapi);
+                encodeTimer.setBytes(buf.size());
+            } else {
+                Magick::Image &image = *images[i];
+                if (t.scale > 1 || t.maxSize) {
+                    PhaseTimer resizeTimer(tt, phWriteConvert);
+                    int width = static_cast<int>(image.columns());
+                    int height = static_cast<int>(image.rows());
+                    int scaledWidth;
+                    int scaledHeight;
+                    scaledSize(width, height, t.scale, t.maxSize, scaledWidth, scaledHeight);
+                    if (scaledWidth != width || scaledHeight != height) {
+                        Magick::Geometry geometry(scaledWidth, scaledHeight);
+                        geometry.aspect(true);
+                        image.resize(geometry);
+                        for (auto &layer : layerImages)
+                            layer.resize(geometry);
+                    }
+                }
+                PhaseTimer encodeTimer(tt, phEncode);
+                encodeImage(image, buf, &layerImages);
+                encodeTimer.setBytes(buf.size());
+            }
+        } catch (Magick::Exception &e) {
+            errors[i] = std::string("ImageMagick error: ") + e.what();
+            return;
+        }
+        if (finish)
+            errors[i] = finish(i, buf, tt);
+    });
+
+    for (int i = 0; i < numTargets; i++) {
+        for (int phase = 0; phase < phNumPhases; phase++)
+            timings.ns[phase] += targetTimings[i].ns[phase];
+        timings.bytes += targetTimings[i].bytes;
+    }
+    for (const auto &error : errors)
+        if (!error.empty())
+            return error;
+    return std::string();
+}
+
+static inline bool frameDimsMatch(const VSFrame *a, const VSFrame *b, const VSAPI *vsapi) {
+    return vsapi->getFrameWidth(a, 0) == vsapi->getFrameWidth(b, 0) &&
+           vsapi->getFrameHeight(b, 0) == vsapi->getFrameHeight(b, 0);
+}
+
+// writes out queued frames for as long as they're next in order
+static bool flushPendingFrames(WriteData *d) {
+    auto iter = d->pendingFrames.begin();
+    while (iter != d->pendingFrames.end() && iter->first == d->nextFrame) {
+        if (!writeToFd(d->fd, iter->second.data(), iter->second.size()))
+            return false;
+        d->nextFrame++;
+        iter = d->pendingFrames.erase(iter);
+    }
+    return true;
+}
+
+// Checks that frame n can still be written to the stream, must be called with streamMutex held. Frames more than
+// streamWindow ahead of the next one are refused to keep the memory used by queued frames bounded, as are all
+// frames after one that failed since the gap it leaves can never be filled.
+static std::string checkStreamFrame(const WriteData *d, int n) {
+    if (d->failedFrame >= 0 && n > d->failedFrame)
+        return "Frame " + std::to_string(d->failedFrame) + " couldn't be written to the file descriptor so frame " + std::to_string(n) + " can't be either";
+    if (n >= d->nextFrame + d->streamWindow)
+        return "Frame " + std::to_string(n) + " is too far ahead of frame " + std::to_string(d->nextFrame) + ", frames must be requested in order when writing to a file descriptor";
+    return std::string();
+}
+
+// frames finish encoding out of order with fmParallelRequests so anything that isn't next in line is queued until it is
+static std::string streamFrame(WriteData *d, int n, const OutputBuffer &buf) {
+    std::lock_guard<std::mutex> lock(d->streamMutex);
+    std::string error = checkStreamFrame(d, n);
+    if (!error.empty())
+        return error;
+    if (n != d->nextFrame) {
+        if (n > d->nextFrame)
+            d->pendingFrames[n].assign(buf.data(), buf.data() + buf.size());
+        return std::string();
+    }
+
+    if (!writeToFd(d->fd, buf.data(), buf.size())) {
+        d->failedFrame = n;
+        return "Failed to write frame " + std::to_string(n) + " to file descriptor: " + strerror(errno);
+    }
+    d->nextFrame++;
+    if (!flushPendingFrames(d)) {
+        d->failedFrame = d->nextFrame;
+        return "Failed to write frame " + std::to_string(d->nextFrame) + " to file descriptor: " + strerror(errno);
+    }
+    return std::string();
+}
+
+// records that frame n won't be written, which ends the stream at it
+static void failStreamFrame(WriteData *d, int n) {
+    if (d->fd < 0)
+        return;
+    std::lock_guard<std::mutex> lock(d->streamMutex);
+    if (n >= d->nextFrame && (d->failedFrame < 0 || n < d->failedFrame))
+        d->failedFrame = n;
+}
+
+// Temporary names carry the process id and a counter so that several jobs writing the same files, or a
+// preview of the script while it's being rendered, never touch each other's files
+static std::string makeTempSuffix() {
+    static std::atomic<int> instances(0);
+#ifdef _WIN32
+    unsigned long pid = GetCurrentProcessId();
+#else
+    long pid = static_cast<long>(getpid());
+#endif
+    return "." + std::to_string(pid) + "-" + std::to_string(instances++) + ".imwri-tmp";
+}
+
+// Each manifest line is "size mtime checksum filename", later lines replace earlier ones for the same file.
+// Returns the number of lines read.
+static size_t loadManifest(WriteData *d, FILE *f) {
+    char line[8192];
+    size_t lines = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lines++;
+        WriteData::ManifestEntry entry;
+        int pos = 0;
+        if (sscanf(line, "%" SCNu64 " %" SCNd64 " %" SCNx64 " %n", &entry.size, &entry.mtime, &entry.checksum, &pos) != 3 || !pos)
+            continue;
+        std::string filename = line + pos;
+        while (!filename.empty() && (filename.back() == '\n' || filename.back() == '\r'))
+            filename.pop_back();
+        if (!filename.empty())
+            d->manifestEntries[filename] = entry;
+    }
+    return lines;
+}
+
+static bool writeManifestLine(FILE *f, const std::string &filename, const WriteData::ManifestEntry &entry) {
+    return fprintf(f, "%" PRIu64 " %" PRId64 " %016" PRIx64 " %s\n", entry.size, entry.mtime, entry.checksum, filename.c_str()) > 0;
+}
+
+// Rewrites the manifest with a single line per file so that it doesn't keep growing with every run that
+// rewrites or rechecks files. It goes through a temporary file so a crash leaves either the old or the new one.
+static bool compactManifest(WriteData *d) {
+    std::string tempname = d->manifestName + d->tempSuffix;
+    FILE *f = openFile(tempname, "wb");
+    if (!f)
+        return false;
+    bool success = true;
+    for (const auto &iter : d->manifestEntries)
+        success = success && writeManifestLine(f, iter.first, iter.second);
+    success = !fclose(f) && success;
+    success = success && (!d->syncInterval || syncFile(tempname)) && renameFile(tempname, d->manifestName);
+    if (!success) {
+        int error = errno;
+        removeFile(tempname);
+        errno = error;
+    }
+    return success;
+}
+
+static void recordManifestEntry(WriteData *d, const std::string &filename, uint64_t checksum) {
+    WriteData::ManifestEntry entry = { 0, 0, checksum };
+    if (!getFileSizeAndTime(filename, entry.size, entry.mtime))
+        return;
+    std::lock_guard<std::mutex> lock(d->manifestMutex);
+    d->manifestEntries[filename] = entry;
+    writeManifestLine(d->manifest, filename, entry);
+    fflush(d->manifest);
+}
+
+// An existing file is trusted if it's recorded as complete and hasn't been touched since. The size and a
+// nanosecond modification time settle that with a single lookup. When the file system only stores whole
+// seconds a file rewritten within the same second could look unchanged, and a changed time doesn't mean
+// the contents changed, so in those cases the whole file is read and compared against the recorded checksum.
+// On such file systems that happens for every file on every resume.
+static bool manifestMatches(WriteData *d, const std::string &filename) {
+    uint64_t size;
+    int64_t mtime;
+    if (!getFileSizeAndTime(filename, size, mtime))
+        return false;
+    WriteData::ManifestEntry entry;
+    {
+        std::lock_guard<std::mutex> lock(d->manifestMutex);
+        auto iter = d->manifestEntries.find(filename);
+        if (iter == d->manifestEntries.end())
+            return false;
+        entry = iter->second;
+    }
+    if (entry.size != size)
+        return false;
+    if (entry.mtime == mtime && mtime % 1000000000)
+        return true;
+
+    std::vector<unsigned char> data;
+    if (!readFile(filename, data) || data.size() != size)
+        return false;
+    Hasher hasher;
+    hasher.update(data.data(), data.size());
+    if (hasher.digest() != entry.checksum)
+        return false;
+    // the new time saves reading the file again the next time
+    if (entry.mtime != mtime)
+        recordManifestEntry(d, filename, entry.checksum);
+    return true;
+}
+
+// Must be called with syncMutex held. The whole batch is always taken off the list, a file that can't be flushed
+// or renamed is deleted so that later batches don't run into it again, and false is returned with the errno of
+// the first failure once the rest of the batch is done.
+static bool syncPendingFiles(WriteData *d) {
+    std::vector<std::pair<std::string, uint64_t>> renamed;
+    int error = 0;
+    for (const auto &iter : d->unsyncedFiles) {
+        std::string tempname = iter.first + d->tempSuffix;
+        if (syncFile(tempname) && renameFile(tempname, iter.first)) {
+            renamed.push_back(iter);
+        } else {
+            if (!error)
+                error = errno;
+            removeFile(tempname);
+        }
+    }
+    d->unsyncedFiles.clear();
+    // all frames usually share a single directory
+    std::string lastDir;
+    for (const auto &iter : renamed) {
+        std::string dir = iter.first.substr(0, iter.first.find_last_of("/\\") + 1);
+        if (dir != lastDir)
+            syncParentDirectory(iter.first);
+        lastDir = dir;
+    }
+    if (d->manifest && !renamed.empty()) {
+        for (const auto &iter : renamed)
+            recordManifestEntry(d, iter.first, iter.second);
+        if (!syncFile(d->manifestName) && !error)
+            error = errno;
+    }
+    errno = error;
+    return !error;
+}
+
+// Output is first written to a temporary file which is renamed into place once complete so that a crash never
+// leaves a partial file under the final name. When syncing in batches the renames are held back until the
+// batch has been flushed to disk, a file under its final name is therefore always complete and durable.
+static bool publishFile(WriteData *d, const std::string &filename, uint64_t checksum) {
+    std::string tempname = filename + d->tempSuffix;
+    if (d->syncInterval <= 1) {
+        if (!renameFile(tempname, filename))
+            return false;
+        if (d->syncInterval == 1)
+            syncParentDirectory(filename);
+        if (d->manifest) {
+            recordManifestEntry(d, filename, checksum);
+            if (d->syncInterval == 1 && !syncFile(d->manifestName))
+                return false;
+        }
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(d->syncMutex);
+    d->unsyncedFiles.emplace_back(filename, checksum);
+    if (static_cast<int>(d->unsyncedFiles.size()) >= d->syncInterval)
+        return syncPendingFiles(d);
+    return true;
+}
+
+// True if filename has been written by this filter but is still waiting for its batch to be synced and renamed
+static bool isUnsyncedFile(WriteData *d, const std::string &filename) {
+    if (d->syncInterval <= 1)
+        return false;
+    std::lock_guard<std::mutex> lock(d->syncMutex);
+    for (const auto &iter : d->unsyncedFiles)
+        if (iter.first == filename)
+            return true;
+    return false;
+}
+
+static bool commitFile(WriteData *d, const std::string &filename, const OutputBuffer &buf, uint64_t &checksum) {
+    if (!writeFile(filename + d->tempSuffix, buf.data(), buf.size(), d->syncInterval == 1)) {
+        int error = errno;
+        removeFile(filename + d->tempSuffix);
+        errno = error;
+        return false;
+    }
+
+    checksum = 0;
+    if (d->manifest) {
+        Hasher hasher;
+        hasher.update(buf.data(), buf.size());
+        checksum = hasher.digest();
+    }
+
+    return publishFile(d, filename, checksum);
+}
+
+// Hashes everything that determines the encoded output, the format, dimensions and the visible part of every plane
+// of the frame, its alpha and its layers, missing frames are skipped
+static uint64_t hashFrames(const std::vector<const VSFrame *> &frames, const VSAPI *vsapi) {
+    Hasher hasher;
+    for (const VSFrame *f : frames) {
+        if (!f)
+            continue;
+        const VSVideoFormat *fi = vsapi->getVideoFrameFormat(f);
+        int header[] = { fi->colorFamily, fi->sampleType, fi->bitsPerSample, fi->subSamplingW, fi->subSamplingH, vsapi->getFrameWidth(f, 0), vsapi->getFrameHeight(f, 0) };
+        hasher.update(header, sizeof(header));
+        for (int plane = 0; plane < fi->numPlanes; plane++) {
+            const uint8_t *src = vsapi->getReadPtr(f, plane);
+            ptrdiff_t stride = vsapi->getStride(f, plane);
+            size_t rowSize = static_cast<size_t>(vsapi->getFrameWidth(f, plane)) * fi->bytesPerSample;
+            int height = vsapi->getFrameHeight(f, plane);
+            for (int y = 0; y < height; y++, src += stride)
+                hasher.update(src, rowSize);
+        }
+    }
+    return hasher.digest();
+}
+
+// Gives filename the contents of an identical file that was written earlier, by cloning or hard linking it
+// where possible and copying it otherwise. It goes through a temporary file just like a newly encoded one.
+static bool commitDuplicate(WriteData *d, const std::string &filename, const WriteData::DedupeEntry &source) {
+    if (filename == source.filename)
+        return true;
+
+    std::string tempname = filename + d->tempSuffix;
+    removeFile(tempname);
+    {
+        // when syncing in batches the source may still be waiting to be renamed into place
+        std::unique_lock<std::mutex> lock(d->syncMutex, std::defer_lock);
+        std::string sourcename = source.filename;
+        if (d->syncInterval > 1) {
+            lock.lock();
+            if (fileExists(sourcename + d->tempSuffix))
+                sourcename += d->tempSuffix;
+        }
+        if (!cloneFile(sourcename, tempname)) {
+            std::vector<unsigned char> data;
+            if (!readFile(sourcename, data) || !writeFile(tempname, data.data(), data.size(), false))
+                return false;
+        }
+    }
+
+    if (d->syncInterval == 1 && !syncFile(tempname))
+        return false;
+    return publishFile(d, filename, source.checksum);
+}
+
+static const VSFrame *VS_CC writeGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    WriteData *d = static_cast<WriteData *>(instanceData);
+
+    if (activationReason == arInitial) {
+        vsapi->requestFrameFilter(n, d->videoNode, frameCtx);
+        if (d->alphaNode)
+            vsapi->requestFrameFilter(n, d->alphaNode, frameCtx);
+        for (VSNode *node : d->layerNodes)
+            vsapi->requestFrameFilter(n, node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        const VSFrame *frame = vsapi->getFrameFilter(n, d->videoNode, frameCtx);
+        const VSFrame *alphaFrame = nullptr;
+        int numTargets = static_cast<int>(d->targets.size());
+
+        std::vector<std::string> filenames(numTargets);
+        std::vector<bool> needed(numTargets, true);
+        bool allNeeded = true;
+        if (d->fd >= 0) {
+            // frames requested a second time have already been written or queued
+            std::lock_guard<std::mutex> lock(d->streamMutex);
+            if (n < d->nextFrame || d->pendingFrames.count(n))
+                return frame;
+            // fail early instead of encoding a frame that can't be written anyway
+            std::string error = checkStreamFrame(d, n);
+            if (!error.empty()) {
+                vsapi->setFilterError(("Write: " + error).c_str(), frameCtx);
+                vsapi->freeFrame(frame);
+                return nullptr;
+            }
+        } else {
+            bool anyNeeded = false;
+            for (int i = 0; i < numTargets; i++) {
+                std::string &filename = filenames[i];
+                filename = specialPrintf(d->targets[i].filename, n + d->firstNum);
+                if (!isAbsolute(filename))
+                    filename = d->workingDir + filename;
+
+                // a frame requested again before its batch is synced only exists under the temporary name
+                if (isUnsyncedFile(d, filename))
+                    needed[i] = false;
+                else if (d->manifest)
+                    needed[i] = !manifestMatches(d, filename);
+                else
+                    needed[i] = d->overwrite || !fileExists(filename);
+                anyNeeded = anyNeeded || needed[i];
+                allNeeded = allNeeded && needed[i];
+            }
+            if (!anyNeeded)
+                return frame;
+        }
+
+        if (d->alphaNode) {
+            alphaFrame = vsapi->getFrameFilter(n, d->alphaNode, frameCtx);
+
+            if (!frameDimsMatch(frame, alphaFrame, vsapi)) {
+                vsapi->setFilterError("Write: Mismatched dimension of the alpha clip", frameCtx);
+                failStreamFrame(d, n);
+                vsapi->freeFrame(frame);
+                vsapi->freeFrame(alphaFrame);
+                return nullptr;
+            }
+        }
+
+        // layers are freed together with the frame by the guard when returning
+        std::vector<const VSFrame *> layerFrames;
+        for (VSNode *node : d->layerNodes)
+            layerFrames.push_back(vsapi->getFrameFilter(n, node, frameCtx));
+        struct LayerGuard {
+            std::vector<const VSFrame *> &frames;
+            const VSAPI *vsapi;
+            ~LayerGuard() {
+                for (const VSFrame *f : frames)
+                    vsapi->freeFrame(f);
+            }
+        } layerGuard = { layerFrames, vsapi };
+
+        FrameTimings timings;
+        timings.frame = n;
+        const VSFrame *dithered = nullptr;
+
+        try {
+            static thread_local std::vector<OutputBuffer> buffers;
+            buffers.resize(numTargets);
+            uint64_t frameHash = 0;
+            bool duplicate = false;
+            std::vector<WriteData::DedupeEntry> originals;
+            if (d->dedupe) {
+                PhaseTimer hashTimer(timings, phWriteConvert);
+                std::vector<const VSFrame *> hashed = { frame, alphaFrame };
+                hashed.insert(hashed.end(), layerFrames.begin(), layerFrames.end());
+                frameHash = hashFrames(hashed, vsapi);
+                hashTimer.stop();
+                std::lock_guard<std::mutex> lock(d->dedupeMutex);
+                auto iter = d->dedupeFiles.find(frameHash);
+                if (iter != d->dedupeFiles.end()) {
+                    duplicate = true;
+                    originals = iter->second;
+                }
+            }
+
+            if (duplicate) {
+                vsapi->freeFrame(alphaFrame);
+                alphaFrame = nullptr;
+                PhaseTimer writeTimer(timings, phWriteFile);
+                for (int i = 0; i < numTargets; i++) {
+                    if (needed[i] && !commitDuplicate(d, filenames[i], originals[i])) {
+                        vsapi->setFilterError((std::string("Write: Failed to write ") + filenames[i] + " as a copy of " + originals[i].filename + ": " + strerror(errno)).c_str(), frameCtx);
+                        vsapi->freeFrame(frame);
+                        return nullptr;
+                    }
+                }
+            } else {
+                if (d->depth) {
+                    PhaseTimer ditherTimer(timings, phWriteConvert);
+                    dithered = ditherFrame(d, frame, d->ditheredFormat, core, vsapi);
+                    if (alphaFrame) {
+                        const VSFrame *ditheredAlpha = ditherFrame(d, alphaFrame, d->ditheredAlphaFormat, core, vsapi);
+                        vsapi->freeFrame(alphaFrame);
+                        alphaFrame = ditheredAlpha;
+                    }
+                }
+                const VSFrame *source = dithered ? dithered : frame;
+
+                std::vector<uint64_t> checksums(numTargets);
+                std::string error = encodeTargets(d, source, alphaFrame, layerFrames, needed, buffers, timings, [&](int i, const OutputBuffer &buf, FrameTimings &targetTimings) {
+                    PhaseTimer writeTimer(targetTimings, phWriteFile);
+                    writeTimer.setBytes(buf.size());
+                    if (d->fd >= 0) {
+                        std::string streamError = streamFrame(d, n, buf);
+                        if (!streamError.empty())
+                            return streamError;
+                    } else if (!commitFile(d, filenames[i], buf, checksums[i])) {
+                        return std::string("Failed to write ") + filenames[i] + ": " + strerror(errno);
+                    }
+                    return std::string();
+                }, core, vsapi);
+                vsapi->freeFrame(alphaFrame);
+                alphaFrame = nullptr;
+                vsapi->freeFrame(dithered);
+                dithered = nullptr;
+
+                if (!error.empty()) {
+                    vsapi->setFilterError(("Write: " + error).c_str(), frameCtx);
+                    failStreamFrame(d, n);
+                    vsapi->freeFrame(frame);
+                    return nullptr;
+                }
+
+                // only frames written to every target can be linked to later
+                if (d->dedupe && allNeeded) {
+                    std::vector<WriteData::DedupeEntry> entries(numTargets);
+                    for (int i = 0; i < numTargets; i++)
+                        entries[i] = { filenames[i], checksums[i] };
+                    std::lock_guard<std::mutex> lock(d->dedupeMutex);
+                    d->dedupeFiles.emplace(frameHash, std::move(entries));
+                }
+            }
+
+            if (d->timing) {
+                VSFrame *dst = vsapi->copyFrame(frame, core);
+                vsapi->freeFrame(frame);
+                setTimingProps(vsapi->getFramePropertiesRW(dst), timings, vsapi);
+                return dst;
+            }
+
+            return frame;
+        } catch (Magick::Exception &e) {
+            vsapi->setFilterError((std::string("Write: ImageMagick error: ") + e.what()).c_str(), frameCtx);
+            failStreamFrame(d, n);
+            vsapi->freeFrame(frame);
+            vsapi->freeFrame(alphaFrame);
+            vsapi->freeFrame(dithered);
+            return nullptr;
+        }
+    }
+
+    return nullptr;
+}
+
+static void VS_CC writeFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    WriteData *d = static_cast<WriteData *>(instanceData);
+    // frames queued after a gap are dropped since writing them would make the stream skip frames unnoticed
+    if (!d->pendingFrames.empty())
+        vsapi->logMessage(mtCritical, ("Write: Frame " + std::to_string(d->failedFrame >= 0 ? d->failedFrame : d->nextFrame) + " was never written to the file descriptor, " +
+            std::to_string(d->pendingFrames.size()) + " encoded frames after it were discarded").c_str(), core);
+    if (!d->unsyncedFiles.empty() && !syncPendingFiles(d))
+        vsapi->logMessage(mtWarning, (std::string("Write: Failed to flush written files to disk: ") + strerror(errno)).c_str(), core);
+    if (d->manifest)
+        fclose(d->manifest);
+    vsapi->freeNode(d->videoNode);
+    vsapi->freeNode(d->alphaNode);
+    for (VSNode *node : d->layerNodes)
+        vsapi->freeNode(node);
+    delete d;
+}
+
+static const char *setCompressionType(WriteTarget &t, const char *compressType) {
+    std::string s = upperCase(compressType);
+    if (s == "" || s == "UNDEFINED")
+        t.compressType = MagickCore::UndefinedCompression;
+    else if (s == "NONE")
+        t.compressType = MagickCore::NoCompression;
+    else if (s == "BZIP")
+        t.compressType = MagickCore::BZipCompression;
+    else if (s == "DXT1")
+        t.compressType = MagickCore::DXT1Compression;
+    else if (s == "DXT3")
+        t.compressType = MagickCore::DXT3Compression;
+    else if (s == "DXT5")
+        t.compressType = MagickCore::DXT5Compression;
+    else if (s == "FAX")
+        t.compressType = MagickCore::FaxCompression;
+    else if (s == "GROUP4")
+        t.compressType = MagickCore::Group4Compression;
+    else if (s == "JPEG")
+        t.compressType = MagickCore::JPEGCompression;
+    else if (s == "JPEG2000")
+        t.compressType = MagickCore::JPEG2000Compression;
+    else if (s == "LOSSLESSJPEG")
+        t.compressType = MagickCore::LosslessJPEGCompression;
+    else if (s == "LZW")
+        t.compressType = MagickCore::LZWCompression;
+    else if (s == "RLE")
+        t.compressType = MagickCore::RLECompression;
+    else if (s == "ZIP")
+        t.compressType = MagickCore::ZipCompression;
+    else if (s == "ZIPS")
+        t.compressType = MagickCore::ZipSCompression;
+    else if (s == "PIZ")
+        t.compressType = MagickCore::PizCompression;
+    else if (s == "PXR24")
+        t.compressType = MagickCore::Pxr24Compression;
+    else if (s == "B44")
+        t.compressType = MagickCore::B44Compression;
+    else if (s == "B44A")
+        t.compressType = MagickCore::B44ACompression;
+    else if (s == "LZMA")
+        t.compressType = MagickCore::LZMACompression;
+    else if (s == "JBIG1")
+        t.compressType = MagickCore::JBIG1Compression;
+    else if (s == "JBIG2")
+        t.compressType = MagickCore::JBIG2Compression;
+#if defined(IMWRI_HAS_OPENEXR)
+    else if (s == "DWAA")
+        t.exrCompression = Imf::DWAA_COMPRESSION;
+    else if (s == "DWAB")
+        t.exrCompression = Imf::DWAB_COMPRESSION;
+#endif
+    else {
+        return "Unrecognized compression type";
+    }
+    return nullptr;
+}
+
+static const char* fillWriteDataFromMap(const VSMap *in, std::unique_ptr<WriteData> &d, const VSAPI *vsapi) {
+    int err = 0;
+    // per-target arguments take a single value for all targets or one value per target
+    int numTargets = vsapi->mapNumElements(in, "imgformat");
+    static const char *targetKeys[] = { "quality", "compression_level", "compression_type", "scale", "max_size" };
+    for (const char *key : targetKeys) {
+        int num = vsapi->mapNumElements(in, key);
+        if (num > 1 && num != numTargets)
+            return "Quality, compression_level, compression_type, scale and max_size must have a single value or one per imgformat";
+    }
+    auto targetIndex = [&](const char *key, int target) {
+        return vsapi->mapNumElements(in, key) > 1 ? target : 0;
+    };
+
+    d->targets.resize(numTargets);
+    for (int i = 0; i < numTargets; i++) {
+        WriteTarget &t = d->targets[i];
+        t.imgFormat = vsapi->mapGetData(in, "imgformat", i, nullptr);
+
+        t.quality = vsapi->mapGetIntSaturated(in, "quality", targetIndex("quality", i), &err);
+        if (err)
+            t.quality = 75;
+        if (t.quality < 0 || t.quality > 100)
+            return "Quality must be between 0 and 100";
+
+        t.compressionLevel = vsapi->mapGetIntSaturated(in, "compression_level", targetIndex("compression_level", i), &err);
+        if (err)
+            t.compressionLevel = -1;
+        else if (t.compressionLevel < 0 || t.compressionLevel > 9)
+            return "Compression level must be between 0 and 9";
+
+        const char *compressType = vsapi->mapGetData(in, "compression_type", targetIndex("compression_type", i), &err);
+        if (!err) {
+            const char *errMsg = setCompressionType(t, compressType);
+            if (errMsg)
+                return errMsg;
+        }
+
+        t.scale = vsapi->mapGetIntSaturated(in, "scale", targetIndex("scale", i), &err);
+        if (err)
+            t.scale = 1;
+        else if (t.scale < 1)
+            return "Scale must be at least 1";
+
+        t.maxSize = vsapi->mapGetIntSaturated(in, "max_size", targetIndex("max_size", i), &err);
+        if (t.maxSize < 0)
+            return "Maximum size can't be negative";
+    }
 
-    const char *compressType = vsapi->mapGetData(in, "compression_type", 0, &err);
-    if (!err) {
-        std::string s = compressType;
-        std::transform(s.begin(), s.end(), s.begin(), toupper);
-        if (s == "" || s == "UNDEFINED")
-            d->compressType = MagickCore::UndefinedCompression;
-        else if (s == "NONE")
-            d->compressType = MagickCore::NoCompression;
-        else if (s == "BZIP")
-            d->compressType = MagickCore::BZipCompression;
-        else if (s == "DXT1")
-            d->compressType = MagickCore::DXT1Compression;
-        else if (s == "DXT3")
-            d->compressType = MagickCore::DXT3Compression;
-        else if (s == "DXT5")
-            d->compressType = MagickCore::DXT5Compression;
-        else if (s == "FAX")
-            d->compressType = MagickCore::FaxCompression;
-        else if (s == "GROUP4")
-            d->compressType = MagickCore::Group4Compression;
-        else if (s == "JPEG")
-            d->compressType = MagickCore::JPEGCompression;
-        else if (s == "JPEG2000")
-            d->compressType = MagickCore::JPEG2000Compression;
-        else if (s == "LOSSLESSJPEG")
-            d->compressType = MagickCore::LosslessJPEGCompression;
-        else if (s == "LZW")
-            d->compressType = MagickCore::LZWCompression;
-        else if (s == "RLE")
-            d->compressType = MagickCore::RLECompression;
-        else if (s == "ZIP")
-            d->compressType = MagickCore::ZipCompression;
-        else if (s == "ZIPS")
-            d->compressType = MagickCore::ZipSCompression;
-        else if (s == "PIZ")
-            d->compressType = MagickCore::PizCompression;
-        else if (s == "PXR24")
-            d->compressType = MagickCore::Pxr24Compression;
-        else if (s == "B44")
-            d->compressType = MagickCore::B44Compression;
-        else if (s == "B44A")
-            d->compressType = MagickCore::B44ACompression;
-        else if (s == "LZMA")
-            d->compressType = MagickCore::LZMACompression;
-        else if (s == "JBIG1")
-            d->compressType = MagickCore::JBIG1Compression;
-        else if (s == "JBIG2")
-            d->compressType = MagickCore::JBIG2Compression;
-        else {
-            return "Unrecognized compression type";
-        }
-    }
-
-    d->imgFormat = vsapi->mapGetData(in, "imgformat", 0, nullptr);
     d->dither = !!vsapi->mapGetInt(in, "dither", 0, &err);
     if (err)
         d->dither = true;
 
+    d->depth = vsapi->mapGetIntSaturated(in, "depth", 0, &err);
+    if (err)
+        d->depth = 0;
+    else if (d->depth < 8 || d->depth > 16)
+        return "Depth must be between 8 and 16";
+
+    const char *ditherType = vsapi->mapGetData(in, "dither_type", 0, &err);
+    if (!err) {
+        std::string s = upperCase(ditherType);
+        if (s == "NONE")
+            d->ditherType = ditherNone;
+        else if (s == "ORDERED")
+            d->ditherType = ditherOrdered;
+        else if (s == "BLUENOISE")
+            d->ditherType = ditherBlueNoise;
+        else
+            return "Unrecognized dither type";
+    }
+
+    return nullptr;
+}
+
+// Layers are written into the same file as the main clip, natively as EXR channels or by ImageMagick as further
+// images for formats that hold several, such as TIFF. Returns an error message if that's not possible.
+static const char *setLayers(WriteData *d, const VSMap *in, VSCore *core, const VSAPI *vsapi) {
+    int numLayers = vsapi->mapNumElements(in, "layers");
+    int numNames = vsapi->mapNumElements(in, "layer_names");
+    if (numLayers <= 0)
+        return numNames > 0 ? "Layer names require layers" : nullptr;
+
+    for (int i = 0; i < numLayers; i++) {
+        d->layerNodes.push_back(vsapi->mapGetNode(in, "layers", i, nullptr));
+        d->layerNames.push_back(numNames > 0 ? vsapi->mapGetData(in, "layer_names", std::min(i, numNames - 1), nullptr) : "layer" + std::to_string(i + 1));
+    }
+
+    if (numNames > 0 && numNames != numLayers)
+        return "There must be one layer name per layer";
+    for (int i = 0; i < numLayers; i++) {
+        if (d->layerNames[i].empty())
+            return "Layer names can't be empty";
+        for (int j = 0; j < i; j++)
+            if (d->layerNames[i] == d->layerNames[j])
+                return "Layer names must be unique";
+    }
+    if (d->targets.size() > 1)
+        return "Layers can only be written with a single imgformat";
+    if (d->depth)
+        return "Layers can't be combined with depth";
+
+    const WriteTarget &t = d->targets[0];
+    if (t.nativeEncoder == WriteTarget::neNone) {
+        initMagick(core, vsapi);
+        MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
+        const MagickCore::MagickInfo *info = MagickCore::GetMagickInfo(t.imgFormat.c_str(), exception);
+        MagickCore::DestroyExceptionInfo(exception);
+        if (!info || !MagickCore::GetMagickAdjoin(info))
+            return "Layers can only be written to formats that hold several images, such as TIFF, or to float EXR";
+    } else if (t.nativeEncoder != WriteTarget::neEXR) {
+        return "Layers can only be written to formats that hold several images, such as TIFF, or to float EXR";
+    }
+
+    for (VSNode *node : d->layerNodes) {
+        const VSVideoFormat &f = vsapi->getVideoInfo(node)->format;
+        if (vsapi->getVideoInfo(node)->width != d->vi->width || vsapi->getVideoInfo(node)->height != d->vi->height)
+            return "Layers must have the same dimensions as the main clip";
+        if ((f.colorFamily != cfRGB && f.colorFamily != cfGray) || (t.nativeEncoder == WriteTarget::neEXR ? f.sampleType != stFloat : (f.sampleType == stFloat && f.bitsPerSample != 32)))
+            return t.nativeEncoder == WriteTarget::neEXR ? "EXR layers must be half or 32 bit float RGB or Grayscale" : "Layers must be 8-32 bit integer or float RGB or Grayscale";
+    }
     return nullptr;
 }
 
@@ -793,8 +2389,6 @@ static void VS_CC writeCreate(const VSMap *in, VSMap *out, void *userData, VSCor
     std::unique_ptr<WriteData> d(new WriteData());
     int err = 0;
 
-    initMagick(core, vsapi);
-
     const char *errMsg = fillWriteDataFromMap(in, d, vsapi);
     if (errMsg) {
         vsapi->mapSetError(out, (std::string("Write: ") + errMsg).c_str());
@@ -809,17 +2403,69 @@ static void VS_CC writeCreate(const VSMap *in, VSMap *out, void *userData, VSCor
 
     d->videoNode = vsapi->mapGetNode(in, "clip", 0, nullptr);
     d->vi = vsapi->getVideoInfo(d->videoNode);
-    if ((d->vi->format.colorFamily != cfRGB && d->vi->format.colorFamily != cfGray)
-        || (d->vi->format.sampleType == stFloat && d->vi->format.bitsPerSample != 32))
-    {
+    errMsg = setDitheredFormats(d.get(), d->vi->format, core, vsapi);
+    if (errMsg) {
+        vsapi->freeNode(d->videoNode);
+        vsapi->mapSetError(out, (std::string("Write: ") + errMsg).c_str());
+        return;
+    }
+
+    errMsg = selectTargetEncoders(d.get(), d->ditheredFormat, vsapi->mapNumElements(in, "alpha") > 0);
+    if (errMsg) {
         vsapi->freeNode(d->videoNode);
-        vsapi->mapSetError(out, "Write: Only constant format 8-32 bit integer or float RGB and Grayscale input supported");
+        vsapi->mapSetError(out, (std::string("Write: ") + errMsg).c_str());
         return;
     }
 
     d->alphaNode = vsapi->mapGetNode(in, "alpha", 0, &err);
-    d->filename = vsapi->mapGetData(in, "filename", 0, nullptr);
     d->overwrite = !!vsapi->mapGetInt(in, "overwrite", 0, &err);
+    d->timing = !!vsapi->mapGetInt(in, "timing", 0, &err);
+    d->fd = vsapi->mapGetIntSaturated(in, "fd", 0, &err);
+    if (err)
+        d->fd = -1;
+    if (d->fd >= 0) {
+        // frames finish at most about as far ahead as there are threads working on them
+        VSCoreInfo info;
+        vsapi->getCoreInfo(core, &info);
+        d->streamWindow = std::max(16, 4 * info.numThreads);
+    }
+    d->dedupe = !!vsapi->mapGetInt(in, "dedupe", 0, &err);
+    if (d->dedupe && d->fd >= 0) {
+        vsapi->freeNode(d->videoNode);
+        vsapi->freeNode(d->alphaNode);
+        vsapi->mapSetError(out, "Write: Dedupe can't be used when writing to a file descriptor");
+        return;
+    }
+    d->syncInterval = vsapi->mapGetIntSaturated(in, "sync", 0, &err);
+    if (d->syncInterval < 0) {
+        vsapi->freeNode(d->videoNode);
+        vsapi->freeNode(d->alphaNode);
+        vsapi->mapSetError(out, "Write: Sync interval can't be negative");
+        return;
+    }
+
+    int numFilenames = vsapi->mapNumElements(in, "filename");
+    const char *targetError = nullptr;
+    if (numFilenames > 0) {
+        if (numFilenames != static_cast<int>(d->targets.size()))
+            targetError = "Write: There must be one filename per imgformat";
+        for (int i = 0; i < numFilenames && !targetError; i++)
+            d->targets[i].filename = vsapi->mapGetData(in, "filename", i, nullptr);
+        for (int i = 0; i < numFilenames && !targetError; i++)
+            for (int j = 0; j < i; j++)
+                if (d->targets[i].filename == d->targets[j].filename)
+                    targetError = "Write: Every imgformat needs its own filename";
+    } else if (d->fd < 0) {
+        targetError = "Write: Either filename or fd must be set";
+    }
+    if (!targetError && d->fd >= 0 && d->targets.size() > 1)
+        targetError = "Write: Only a single imgformat can be written to a file descriptor";
+    if (targetError) {
+        vsapi->freeNode(d->videoNode);
+        vsapi->freeNode(d->alphaNode);
+        vsapi->mapSetError(out, targetError);
+        return;
+    }
 
     if (d->alphaNode) {
         const VSVideoInfo *alphaVi = vsapi->getVideoInfo(d->alphaNode);
@@ -836,18 +2482,65 @@ static void VS_CC writeCreate(const VSMap *in, VSMap *out, void *userData, VSCor
         
     }
 
-    if (!d->overwrite && specialPrintf(d->filename, 0) == d->filename) {
-        // No valid digit substitution in the filename so error out to warn the user
-        vsapi->freeNode(d->videoNode);
-        vsapi->freeNode(d->alphaNode);
-        vsapi->mapSetError(out, "Write: Filename string doesn't contain a number");
-        return;
+    for (const auto &t : d->targets) {
+        if (d->fd < 0 && !d->overwrite && specialPrintf(t.filename, 0) == t.filename) {
+            // No valid digit substitution in the filename so error out to warn the user
+            vsapi->freeNode(d->videoNode);
+            vsapi->freeNode(d->alphaNode);
+            vsapi->mapSetError(out, "Write: Filename string doesn't contain a number");
+            return;
+        }
     }
 
     getWorkingDir(d->workingDir);
+    d->tempSuffix = makeTempSuffix();
+
+    const char *manifest = vsapi->mapGetData(in, "manifest", 0, &err);
+    if (!err) {
+        std::string &manifestName = d->manifestName;
+        manifestName = manifest;
+        if (!isAbsolute(manifestName))
+            manifestName = d->workingDir + manifestName;
+
+        if (d->fd >= 0) {
+            vsapi->freeNode(d->videoNode);
+            vsapi->freeNode(d->alphaNode);
+            vsapi->mapSetError(out, "Write: A manifest can't be used when writing to a file descriptor");
+            return;
+        }
+
+        FILE *f = openFile(manifestName, "rb");
+        if (f) {
+            size_t lines = loadManifest(d.get(), f);
+            fclose(f);
+            if (lines > d->manifestEntries.size() && !compactManifest(d.get()))
+                vsapi->logMessage(mtWarning, ("Write: Failed to compact manifest " + manifestName + ": " + strerror(errno)).c_str(), core);
+        }
+
+        d->manifest = openFile(manifestName, "ab");
+        if (!d->manifest) {
+            vsapi->freeNode(d->videoNode);
+            vsapi->freeNode(d->alphaNode);
+            vsapi->mapSetError(out, (std::string("Write: Failed to open manifest ") + manifestName + ": " + strerror(errno)).c_str());
+            return;
+        }
+    }
+
+    errMsg = setLayers(d.get(), in, core, vsapi);
+    if (errMsg) {
+        vsapi->mapSetError(out, (std::string("Write: ") + errMsg).c_str());
+        writeFree(d.release(), core, vsapi);
+        return;
+    }
 
-    VSFilterDependency deps[] = {{ d->videoNode, rpStrictSpatial }, { d->alphaNode, rpStrictSpatial }};
-    vsapi->createVideoFilter(out, "Write", d->vi, writeGetFrame, writeFree, fmParallelRequests, deps, d->alphaNode ? 2 : 1, d.get(), core);
+    d->pool.reset(new ThreadPool(getImageThreads(core, vsapi) - 1));
+
+    std::vector<VSFilterDependency> deps = {{ d->videoNode, rpStrictSpatial }};
+    if (d->alphaNode)
+        deps.push_back({ d->alphaNode, rpStrictSpatial });
+    for (VSNode *node : d->layerNodes)
+        deps.push_back({ node, rpStrictSpatial });
+    vsapi->createVideoFilter(out, "Write", d->vi, writeGetFrame, writeFree, fmParallelRequests, deps.data(), static_cast<int>(deps.size()), d.get(), core);
     d.release();
 }
 
@@ -855,8 +2548,6 @@ static void VS_CC encodeFrame(const VSMap *in, VSMap *out, void *, VSCore *core,
     std::unique_ptr<WriteData> d(new WriteData());
     int err = 0;
 
-    initMagick(core, vsapi);
-
     const char *errMsg = fillWriteDataFromMap(in, d, vsapi);
     if (errMsg) {
         vsapi->mapSetError(out, (std::string("EncodeFrame: ") + errMsg).c_str());
@@ -865,12 +2556,17 @@ static void VS_CC encodeFrame(const VSMap *in, VSMap *out, void *, VSCore *core,
 
     const VSFrame *frame = vsapi->mapGetFrame(in, "frame", 0, nullptr);
     const VSVideoFormat *fi = vsapi->getVideoFrameFormat(frame);
+    errMsg = setDitheredFormats(d.get(), *fi, core, vsapi);
+    if (errMsg) {
+        vsapi->freeFrame(frame);
+        vsapi->mapSetError(out, (std::string("EncodeFrame: ") + errMsg).c_str());
+        return;
+    }
 
-    if ((fi->colorFamily != cfRGB && fi->colorFamily != cfGray)
-        || (fi->sampleType == stFloat && fi->bitsPerSample != 32))
-    {
+    errMsg = selectTargetEncoders(d.get(), d->ditheredFormat, vsapi->mapNumElements(in, "alpha") > 0);
+    if (errMsg) {
         vsapi->freeFrame(frame);
-        vsapi->mapSetError(out, "EncodeFrame: Only constant format 8-32 bit integer or float RGB and Grayscale input supported");
+        vsapi->mapSetError(out, (std::string("EncodeFrame: ") + errMsg).c_str());
         return;
     }
 
@@ -889,11 +2585,33 @@ static void VS_CC encodeFrame(const VSMap *in, VSMap *out, void *, VSCore *core,
         }
     }
 
-    Magick::Blob data;
+    // The VapourSynth API always copies data into maps so the encoder output is kept in per-thread
+    // buffers that are reused between calls, leaving the copy into the output map as the only one
+    static thread_local std::vector<OutputBuffer> buffers;
+    buffers.resize(d->targets.size());
+    FrameTimings timings;
+
+    if (d->depth) {
+        PhaseTimer ditherTimer(timings, phWriteConvert);
+        const VSFrame *dithered = ditherFrame(d.get(), frame, d->ditheredFormat, core, vsapi);
+        vsapi->freeFrame(frame);
+        frame = dithered;
+        if (alpha) {
+            dithered = ditherFrame(d.get(), alpha, d->ditheredAlphaFormat, core, vsapi);
+            vsapi->freeFrame(alpha);
+            alpha = dithered;
+        }
+    }
+
     try {
-        auto image = frameToImage(frame, alpha, d.get(), vsapi);
-        image.strip();
-        image.write(&data);
+        std::vector<bool> needed(d->targets.size(), true);
+        std::string error = encodeTargets(d.get(), frame, alpha, {}, needed, buffers, timings, nullptr, core, vsapi);
+        if (!error.empty()) {
+            vsapi->mapSetError(out, ("EncodeFrame: " + error).c_str());
+            vsapi->freeFrame(frame);
+            vsapi->freeFrame(alpha);
+            return;
+        }
     } catch (Magick::Exception &e) {
         vsapi->mapSetError(out, (std::string("EncodeFrame: ImageMagick error: ") + e.what()).c_str());
         vsapi->freeFrame(frame);
@@ -901,106 +2619,476 @@ static void VS_CC encodeFrame(const VSMap *in, VSMap *out, void *, VSCore *core,
         return;
     }
 
-    vsapi->freeFrame(frame);
-    vsapi->freeFrame(alpha);
+    vsapi->freeFrame(frame);
+    vsapi->freeFrame(alpha);
+
+    for (const auto &data : buffers)
+        vsapi->mapSetData(out, "bytes", reinterpret_cast<const char *>(data.data()), static_cast<int>(data.size()), dtBinary, maAppend);
+}
+
+//////////////////////////////////////////
+// Read
+
+struct ReadData {
+    VSVideoInfo vi[2];
+    std::vector<std::string> filenames;
+    std::string workingDir;
+    int firstNum;
+    bool alpha;
+    bool mismatch;
+    bool fileListMode;
+    bool floatOutput;
+    int cachedFrameNum;
+    bool cachedAlpha;
+    bool embedICC;
+    bool timing;
+    const VSFrame *cachedFrame;
+    std::vector<unsigned char> fileBuffer; // calls are serialized by fmUnordered so a single buffer can be reused
+    // region of interest, a width or height of 0 extends it to the edge of each image
+    int cropLeft;
+    int cropTop;
+    int cropWidth;
+    int cropHeight;
+    std::string extract; // the region as an ImageMagick geometry, empty when the whole image is used
+    // reduced resolution output, a scale of 1 and maxSize of 0 mean full resolution
+    int scale;
+    int maxSize;
+    bool nativeJPEG; // decode JPEG files with libjpeg-turbo when none of the options need ImageMagick
+    bool nativeEXR; // same for OpenEXR
+    // sequences numbered in steps or with gaps, the file number of every frame is listed when it can't be
+    // calculated from the step, -1 for blank frames
+    int step;
+    enum GapMode {
+        gmStop,
+        gmSkip,
+        gmRepeat,
+        gmBlank
+    } gaps;
+    std::vector<int> fileNumbers;
+    // repeated files are only decoded once, cachedFrame holds the last decoded file cachedFrameNum. All blank
+    // frames are the same frame, which has the format of the first file.
+    VSVideoFormat blankFormat;
+    int blankWidth;
+    int blankHeight;
+    const VSFrame *blankFrame;
+    // the image of a file with several that's read, -1 when not set, or the layer found by name, which is a
+    // part or channel prefix in EXR and the label of an image in other formats
+    int subimage;
+    std::string layer;
+
+    ReadData() : fileListMode(true), cachedFrameNum(-1), cachedFrame(nullptr), step(1), gaps(gmStop), blankFormat(), blankWidth(0), blankHeight(0), blankFrame(nullptr), subimage(-1) {};
+};
+
+// The number of the file a frame comes from, or the index into the file list. -1 for blank frames.
+static int readFileNumber(const ReadData *d, int n) {
+    if (d->fileListMode)
+        return n;
+    return d->fileNumbers.empty() ? d->firstNum + n * d->step : d->fileNumbers[n];
+}
+
+static std::string readFilename(const ReadData *d, int n) {
+    return d->fileListMode ? d->filenames[n] : specialPrintf(d->filenames[0], readFileNumber(d, n));
+}
+
+static void readSampleTypeDepth(bool floatOutput, const Magick::Image &image, VSSampleType &st, int &depth) {
+        st = stInteger;
+        depth = static_cast<int>(image.depth());
+#if !MAGICKCORE_HDRI_ENABLE
+        // the pixel cache can't hold more than the quantum depth so there's no point in returning extra bits
+        if (depth > MAGICKCORE_QUANTUM_DEPTH)
+                depth = MAGICKCORE_QUANTUM_DEPTH;
+#endif
+        if (depth == 32)
+                st = stFloat;
+
+        if (floatOutput || image.attribute("quantum:format") == "floating-point") {
+                depth = 32;
+                st = stFloat;
+        }
+
+        // VapourSynth does not support <8-bit integer types.
+        if (depth < 8)
+                depth = 8;
+}
+
+static VSColorFamily readColorFamily(const Magick::Image &image) {
+    return image.colorSpace() == Magick::GRAYColorspace ? cfGray : cfRGB;
+}
+
+struct DecodeOptions {
+    // Only return this region, as an ImageMagick geometry. A few coders such as JPEG 2000 and raw pixels only
+    // decode the region, all others, TIFF included, decode the whole image which ImageMagick then crops.
+    std::string extract;
+    // The size the image will be scaled down to. Coders that can decode at a reduced resolution (JPEG DCT scaling)
+    // use it to pick the smallest scale that's still at least this large.
+    int width = 0;
+    int height = 0;
+    int reduceFactor = 0; // the number of JPEG 2000 resolution levels to skip
+    bool ping = false; // only read the image properties
+    // The image to return from files with several, such as TIFF directories or PSD layers. Coders that support
+    // it skip decoding the others.
+    int subimage = 0;
+};
+
+// Decodes an image held in memory. The hint is stored as the filename so it can be either a real filename
+// (for extension based format detection) or a "FORMAT:" prefix to force a specific coder. Without data the file
+// named by the hint is read by ImageMagick itself, which also handles its filename syntax such as "PNG:name"
+// or "name.tif[2]".
+static Magick::Image readImage(const void *data, size_t length, const std::string &hint, const DecodeOptions &options = DecodeOptions()) {
+    MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
+    MagickCore::ImageInfo *info = MagickCore::AcquireImageInfo();
+    MagickCore::CopyMagickString(info->filename, hint.c_str(), MagickPathExtent);
+    if (!options.extract.empty())
+        MagickCore::CloneString(&info->extract, options.extract.c_str());
+    if (options.width && options.height)
+        MagickCore::SetImageOption(info, "jpeg:size", (std::to_string(options.width) + "x" + std::to_string(options.height)).c_str());
+    if (options.reduceFactor)
+        MagickCore::SetImageOption(info, "jp2:reduce-factor", std::to_string(options.reduceFactor).c_str());
+    info->ping = options.ping ? MagickCore::MagickTrue : MagickCore::MagickFalse;
+    if (options.subimage) {
+        info->scene = options.subimage;
+        info->number_scenes = 1;
+    }
+    MagickCore::Image *image = data ? MagickCore::BlobToImage(info, data, length, exception) : MagickCore::ReadImage(info, exception);
+    MagickCore::DestroyImageInfo(info);
+
+    try {
+        Magick::throwException(exception);
+    } catch (Magick::Exception &) {
+        if (image)
+            MagickCore::DestroyImageList(image);
+        MagickCore::DestroyExceptionInfo(exception);
+        throw;
+    }
+    MagickCore::DestroyExceptionInfo(exception);
+
+    if (!image)
+        throw Magick::ErrorCorruptImage("Unable to decode image");
+
+    // only the requested image of a sequence is used, by default the first same as Magick::Image::read(). Coders
+    // that don't skip the other images return all of them.
+    MagickCore::Image *selected = image;
+    if (options.subimage && image->next) {
+        MagickCore::Image *byIndex = nullptr;
+        selected = nullptr;
+        int index = 0;
+        for (MagickCore::Image *p = image; p && !selected; p = p->next, index++) {
+            if (static_cast<int>(p->scene) == options.subimage)
+                selected = p;
+            else if (index == options.subimage)
+                byIndex = p;
+        }
+        if (!selected)
+            selected = byIndex;
+        if (!selected) {
+            MagickCore::DestroyImageList(image);
+            throw Magick::ErrorOption("Subimage " + std::to_string(options.subimage) + " doesn't exist");
+        }
+    }
+    if (selected != image) {
+        selected->previous->next = selected->next;
+        if (selected->next)
+            selected->next->previous = selected->previous;
+        selected->previous = nullptr;
+        selected->next = nullptr;
+        MagickCore::DestroyImageList(image);
+    } else if (image->next) {
+        MagickCore::DestroyImageList(image->next);
+        image->next = nullptr;
+    }
+
+    return Magick::Image(selected);
+}
+
+// The subimage to read from the file. A layer is looked up by the labels of the images, which formats
+// such as PSD and TIFF set to the layer or page name, by only reading the headers.
+static int readSubimage(const ReadData *d, const std::string &filename) {
+    if (d->layer.empty())
+        return std::max(d->subimage, 0);
+
+    MagickCore::ExceptionInfo *exception = MagickCore::AcquireExceptionInfo();
+    MagickCore::ImageInfo *info = MagickCore::AcquireImageInfo();
+    MagickCore::CopyMagickString(info->filename, filename.c_str(), MagickPathExtent);
+    MagickCore::Image *images = MagickCore::PingImage(info, exception);
+    MagickCore::DestroyImageInfo(info);
+    int found = -1;
+    int index = 0;
+    for (MagickCore::Image *p = images; p && found < 0; p = MagickCore::GetNextImageInList(p), index++) {
+        const char *label = MagickCore::GetImageProperty(p, "label", exception);
+        if (label && d->layer == label)
+            found = index;
+    }
+    if (images)
+        MagickCore::DestroyImageList(images);
+    MagickCore::DestroyExceptionInfo(exception);
+
+    if (found < 0)
+        throw Magick::ErrorOption("No layer named " + d->layer + " in " + filename);
+    return found;
+}
 
-    vsapi->mapSetData(out, "bytes", static_cast<const char*>(data.data()), data.length(), dtBinary, maReplace);
+// Reads and decodes the file with ImageMagick with the crop or reduced resolution settings applied
+static Magick::Image decodeReadImage(const ReadData *d, const std::string &filename) {
+    DecodeOptions options;
+    options.extract = d->extract;
+    options.subimage = readSubimage(d, filename);
+    if (d->scale == 1 && !d->maxSize)
+        return readImage(nullptr, 0, filename, options);
+
+    // the header has to be read first to know how much the image can be reduced
+    options.ping = true;
+    Magick::Image header = readImage(nullptr, 0, filename, options);
+    int width = static_cast<int>(header.columns());
+    int height = static_cast<int>(header.rows());
+    options.ping = false;
+    scaledSize(width, height, d->scale, d->maxSize, options.width, options.height);
+    while (options.reduceFactor < 31 && (width >> (options.reduceFactor + 1)) >= options.width && (height >> (options.reduceFactor + 1)) >= options.height)
+        options.reduceFactor++;
+
+    Magick::Image image = readImage(nullptr, 0, filename, options);
+    // coders without reduced resolution decoding, and those that could only get close, are resized to the exact size
+    if (static_cast<int>(image.columns()) != options.width || static_cast<int>(image.rows()) != options.height) {
+        Magick::Geometry geometry(options.width, options.height);
+        geometry.aspect(true);
+        image.resize(geometry);
+    }
+    return image;
 }
 
-//////////////////////////////////////////
-// Read
+#if defined(IMWRI_HAS_TURBOJPEG) || defined(IMWRI_HAS_OPENEXR)
+// Whether the native decoders might handle a file that starts with data, at least 4 bytes are needed to tell
+static bool isNativeFile(const ReadData *d, const unsigned char *data, size_t length) {
+    bool native = false;
+#if defined(IMWRI_HAS_TURBOJPEG)
+    native = native || (d->nativeJPEG && length >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF);
+#endif
+#if defined(IMWRI_HAS_OPENEXR)
+    native = native || (d->nativeEXR && isEXR(data, length));
+#endif
+    return native;
+}
+#endif
 
-struct ReadData {
-    VSVideoInfo vi[2];
-    std::vector<std::string> filenames;
-    std::string workingDir;
-    int firstNum;
-    bool alpha;
-    bool mismatch;
-    bool fileListMode;
-    bool floatOutput;
-    int cachedFrameNum;
-    bool cachedAlpha;
-    bool embedICC;
-    const VSFrame *cachedFrame;
+// Loads the file into fileBuffer if the native decoders might handle it, which is told from its first bytes.
+// Otherwise the buffer is left empty and the file is left to ImageMagick, which reads it itself.
+static void loadNativeFile(ReadData *d, const std::string &filename) {
+    d->fileBuffer.clear();
+#if defined(IMWRI_HAS_TURBOJPEG) || defined(IMWRI_HAS_OPENEXR)
+    if (!(d->nativeJPEG || d->nativeEXR) || !readFileHeader(filename, d->fileBuffer, 4))
+        return;
+    if (!isNativeFile(d, d->fileBuffer.data(), d->fileBuffer.size()) || !readFile(filename, d->fileBuffer))
+        d->fileBuffer.clear();
+#endif
+}
 
-    ReadData() : fileListMode(true) {};
-};
+// Converts a decoded image into frame (and alphaFrame if set) which must already have the image's dimensions
+static void imageToFrame(Magick::Image &image, VSFrame *frame, VSFrame *alphaFrame, bool embedICC, const VSAPI *vsapi) {
+    const VSVideoFormat *fi = vsapi->getVideoFrameFormat(frame);
+    int width = vsapi->getFrameWidth(frame, 0);
+    int height = vsapi->getFrameHeight(frame, 0);
 
-template<typename T>
-static void readImageHelper(VSFrame *frame, VSFrame *alphaFrame, bool isGray, Magick::Image &image, int width, int height, int bitsPerSample, const VSAPI *vsapi) {
-    float outScale = ((1 << bitsPerSample) - 1) / static_cast<float>((1 << MAGICKCORE_QUANTUM_DEPTH) - 1);
-    size_t channels = image.channels();
-    Magick::Pixels pixelCache(image);
+    bool isGray = fi->colorFamily == cfGray;
 
-    T *r = reinterpret_cast<T *>(vsapi->getWritePtr(frame, 0));
-    T *g = reinterpret_cast<T *>(vsapi->getWritePtr(frame, isGray ? 0 : 1));
-    T *b = reinterpret_cast<T *>(vsapi->getWritePtr(frame, isGray ? 0 : 2));
+    Planes dst = {};
+    for (int plane = 0; plane < 3; plane++) {
+        dst.ptr[plane] = vsapi->getWritePtr(frame, isGray ? 0 : plane);
+        dst.stride[plane] = vsapi->getStride(frame, isGray ? 0 : plane);
+    }
+    if (alphaFrame) {
+        dst.ptr[3] = vsapi->getWritePtr(alphaFrame, 0);
+        dst.stride[3] = vsapi->getStride(alphaFrame, 0);
+    }
 
-    ptrdiff_t strideR = vsapi->getStride(frame, 0);
-    ptrdiff_t strideG = vsapi->getStride(frame, isGray ? 0 : 1);
-    ptrdiff_t strideB = vsapi->getStride(frame, isGray ? 0 : 2);
+    imageToPlanes(image, dst, width, height, fi->bitsPerSample, fi->bytesPerSample, fi->sampleType == stFloat);
+#if defined(IMWRI_HAS_LCMS2)
+    if (embedICC) {
+        const MagickCore::StringInfo *icc_profile = MagickCore::GetImageProfile(image.constImage(), "icc");
+        if (icc_profile) {
+            vsapi->mapSetData(vsapi->getFramePropertiesRW(frame), "ICCProfile", reinterpret_cast<const char *>(icc_profile->datum), icc_profile->length, dtBinary, maReplace);
+        }
+    }
+#endif
+}
 
-    ssize_t rOff = pixelCache.offset(MagickCore::RedPixelChannel);
-    ssize_t gOff = pixelCache.offset(MagickCore::GreenPixelChannel);
-    ssize_t bOff = pixelCache.offset(MagickCore::BluePixelChannel);
-    ssize_t aOff = pixelCache.offset(MagickCore::AlphaPixelChannel);
+#if defined(IMWRI_HAS_TURBOJPEG)
+struct JPEGInfo {
+    int width;
+    int height;
+    bool gray;
+};
 
-    if (alphaFrame && aOff >= 0) {
-        T *a = reinterpret_cast<T *>(vsapi->getWritePtr(alphaFrame, 0));
-        ptrdiff_t strideA = vsapi->getStride(alphaFrame, 0);
+// Returns false for anything that isn't a JPEG libjpeg-turbo can convert to RGB or gray, CMYK is left to ImageMagick
+static bool readJPEGInfo(const unsigned char *data, size_t length, JPEGInfo &info) {
+    static thread_local TurboJPEGHandle handle(false);
+    if (length < 3 || data[0] != 0xFF || data[1] != 0xD8 || data[2] != 0xFF)
+        return false;
+    int subsampling, colorspace;
+    if (tjDecompressHeader3(handle.get(), data, static_cast<unsigned long>(length), &info.width, &info.height, &subsampling, &colorspace))
+        return false;
+    info.gray = colorspace == TJCS_GRAY;
+    return colorspace == TJCS_GRAY || colorspace == TJCS_YCbCr || colorspace == TJCS_RGB;
+}
 
-        for (int y = 0; y < height; y++) {
-            const Magick::Quantum *pixels = pixelCache.getConst(0, y, width, 1);
-            for (int x = 0; x < width; x++) {
-                r[x] = (unsigned)(pixels[x * channels + rOff] * outScale + .5f);
-                g[x] = (unsigned)(pixels[x * channels + gOff] * outScale + .5f);
-                b[x] = (unsigned)(pixels[x * channels + bOff] * outScale + .5f);
-                a[x] = (unsigned)(pixels[x * channels + aOff] * outScale + .5f);
-            }
+// Decodes into 8 bit RGB or gray frames with the image's dimensions, gray is decoded straight into the frame
+static void decodeJPEG(const unsigned char *data, size_t length, const JPEGInfo &info, VSFrame *frame, VSFrame *alphaFrame, const VSAPI *vsapi) {
+    static thread_local TurboJPEGHandle handle(false);
+    static thread_local std::vector<unsigned char> interleaved;
 
-            r += strideR / sizeof(T);
-            g += strideG / sizeof(T);
-            b += strideB / sizeof(T);
-            a += strideA / sizeof(T);
-        }
+    if (info.gray) {
+        handle.check(tjDecompress2(handle.get(), data, static_cast<unsigned long>(length), vsapi->getWritePtr(frame, 0), info.width, static_cast<int>(vsapi->getStride(frame, 0)), info.height, TJPF_GRAY, 0));
     } else {
-        for (int y = 0; y < height; y++) {
-            const Magick::Quantum *pixels = pixelCache.getConst(0, y, width, 1);
-            for (int x = 0; x < width; x++) {
-                r[x] = (unsigned)(pixels[x * channels + rOff] * outScale + .5f);
-                g[x] = (unsigned)(pixels[x * channels + gOff] * outScale + .5f);
-                b[x] = (unsigned)(pixels[x * channels + bOff] * outScale + .5f);
+        interleaved.resize(static_cast<size_t>(info.width) * info.height * 3);
+        handle.check(tjDecompress2(handle.get(), data, static_cast<unsigned long>(length), interleaved.data(), info.width, info.width * 3, info.height, TJPF_RGB, 0));
+        uint8_t *r = vsapi->getWritePtr(frame, 0);
+        uint8_t *g = vsapi->getWritePtr(frame, 1);
+        uint8_t *b = vsapi->getWritePtr(frame, 2);
+        ptrdiff_t stride = vsapi->getStride(frame, 0);
+        for (int y = 0; y < info.height; y++) {
+            const unsigned char *row = interleaved.data() + static_cast<size_t>(y) * info.width * 3;
+            for (int x = 0; x < info.width; x++) {
+                r[x] = row[x * 3];
+                g[x] = row[x * 3 + 1];
+                b[x] = row[x * 3 + 2];
             }
-
-            r += strideR / sizeof(T);
-            g += strideG / sizeof(T);
-            b += strideB / sizeof(T);
+            r += stride;
+            g += stride;
+            b += stride;
         }
+    }
+
+    // JPEG has no alpha, the plane is zeroed like imageToPlanes() does for images without it
+    if (alphaFrame) {
+        uint8_t *a = vsapi->getWritePtr(alphaFrame, 0);
+        ptrdiff_t stride = vsapi->getStride(alphaFrame, 0);
+        for (int y = 0; y < info.height; y++)
+            memset(a + y * stride, 0, info.width);
+    }
+}
+#endif
 
-        if (alphaFrame) {
-            T *a = reinterpret_cast<T *>(vsapi->getWritePtr(alphaFrame, 0));
-            ptrdiff_t strideA = vsapi->getStride(alphaFrame, 0);
-            memset(a, 0, strideA  * height);
+#if defined(IMWRI_HAS_OPENEXR)
+struct EXRInfo {
+    int width;
+    int height;
+    bool gray;
+    bool half; // all channels are half float
+    int part;
+    std::string prefix; // of the channel names when reading a layer, including the dot
+    std::string grayName; // the channel of grayscale images, usually Y
+};
+
+// Finds the R, G, B or Y channel and optional A among the channels starting with prefix, those of other layers,
+// which have a dot after it, are ignored. A layer with a single channel of another name, such as depth.Z, is
+// read as grayscale. False if there's anything that can't be read.
+static bool readEXRChannels(const Imf::Header &header, const std::string &prefix, EXRInfo &info) {
+    bool rgb[3] = {};
+    int count = 0;
+    std::string other;
+    info.half = true;
+    info.grayName.clear();
+    for (auto it = header.channels().begin(); it != header.channels().end(); ++it) {
+        const Imf::Channel &channel = it.channel();
+        std::string name = it.name();
+        if (name.compare(0, prefix.length(), prefix) || name.find('.', prefix.length()) != std::string::npos)
+            continue;
+        name = name.substr(prefix.length());
+        if (channel.type == Imf::UINT || channel.xSampling != 1 || channel.ySampling != 1)
+            return false;
+        if (name == "R")
+            rgb[0] = true;
+        else if (name == "G")
+            rgb[1] = true;
+        else if (name == "B")
+            rgb[2] = true;
+        else if (name == "Y")
+            info.grayName = name;
+        else if (name != "A")
+            other = name;
+        count++;
+        info.half = info.half && channel.type == Imf::HALF;
+    }
+    if (!other.empty()) {
+        if (count != 1)
+            return false;
+        info.grayName = other;
+    }
+    info.gray = !info.grayName.empty();
+    if (info.gray ? (rgb[0] || rgb[1] || rgb[2]) : !(rgb[0] && rgb[1] && rgb[2]))
+        return false;
+    info.prefix = prefix;
+    const Imf::Box2i &dw = header.dataWindow();
+    info.width = dw.max.x - dw.min.x + 1;
+    info.height = dw.max.y - dw.min.y + 1;
+    return true;
+}
+
+// Only plain RGB(A) and Y(A) images without subsampled channels are handled, everything else is left to ImageMagick.
+// A layer is either a part of its own or a set of channels named layer.R and so on, searched for in all parts
+// unless a subimage is given. Only the selected part is decompressed when the pixels are read.
+static bool readEXRInfo(const unsigned char *data, size_t length, EXRInfo &info, int subimage, const std::string &layer) {
+    if (!isEXR(data, length))
+        return false;
+    try {
+        MemoryIStream stream(data, length);
+        Imf::MultiPartInputFile file(stream, 0);
+        int first = std::max(subimage, 0);
+        int last = (subimage >= 0 || layer.empty()) ? first : file.parts() - 1;
+        for (int part = first; part <= last && part < file.parts(); part++) {
+            const Imf::Header &header = file.header(part);
+            if (header.hasType() && !header.type().compare(0, 4, "deep"))
+                continue;
+            info.part = part;
+            if (layer.empty()) {
+                if (readEXRChannels(header, "", info))
+                    return true;
+            } else if (readEXRChannels(header, layer + ".", info) || (header.hasName() && header.name() == layer && readEXRChannels(header, "", info))) {
+                return true;
+            }
         }
+        return false;
+    } catch (std::exception &) {
+        return false;
     }
 }
 
-static void readSampleTypeDepth(const ReadData *d, const Magick::Image &image, VSSampleType &st, int &depth) {
-        st = stInteger;
-        depth = static_cast<int>(image.depth());
-        if (depth == 32)
-                st = stFloat;
+// Decodes the data window straight into half or float frames, a missing alpha channel is filled with 0
+static void decodeEXR(const unsigned char *data, size_t length, const EXRInfo &info, VSFrame *frame, VSFrame *alphaFrame, int threads, const VSAPI *vsapi) {
+    const VSVideoFormat *fi = vsapi->getVideoFrameFormat(frame);
+    Imf::PixelType type = fi->bitsPerSample == 16 ? Imf::HALF : Imf::FLOAT;
+    static const char *rgbNames[] = { "R", "G", "B" };
 
-        if (d->floatOutput || image.attribute("quantum:format") == "floating-point") {
-                depth = 32;
-                st = stFloat;
+    try {
+        reserveEXRThreads(threads);
+        MemoryIStream stream(data, length);
+        Imf::MultiPartInputFile file(stream, threads > 1 ? threads : 0);
+        Imf::InputPart part(file, info.part);
+        const Imf::Box2i &dw = part.header().dataWindow();
+
+        Imf::FrameBuffer frameBuffer;
+        auto addSlice = [&](const std::string &channel, VSFrame *dst, int plane, double fill) {
+            std::string name = info.prefix + channel;
+            ptrdiff_t stride = vsapi->getStride(dst, plane);
+            // the slice is addressed with the data window's coordinates
+            char *base = reinterpret_cast<char *>(vsapi->getWritePtr(dst, plane)) - dw.min.x * static_cast<ptrdiff_t>(fi->bytesPerSample) - dw.min.y * stride;
+            frameBuffer.insert(name.c_str(), Imf::Slice(type, base, fi->bytesPerSample, stride, 1, 1, fill));
+        };
+        if (fi->colorFamily == cfGray) {
+            addSlice(info.grayName, frame, 0, 0.0);
+        } else {
+            for (int plane = 0; plane < 3; plane++)
+                addSlice(rgbNames[plane], frame, plane, 0.0);
         }
+        // a missing A channel is filled with 0, the same as imageToPlanes() returns for images without alpha
+        if (alphaFrame)
+            addSlice("A", alphaFrame, 0, 0.0);
 
-        // VapourSynth does not support <8-bit integer types.
-        if (depth < 8)
-                depth = 8;
+        part.setFrameBuffer(frameBuffer);
+        part.readPixels(dw.min.y, dw.max.y);
+    } catch (std::exception &e) {
+        throw Magick::ErrorCoder(std::string("OpenEXR: ") + e.what());
+    }
 }
+#endif
 
 static std::string getVideoFormatName(const VSVideoFormat &f, const VSAPI *vsapi) {
     char name[32];
@@ -1010,32 +3098,303 @@ static std::string getVideoFormatName(const VSVideoFormat &f, const VSAPI *vsapi
         return "";
 }
 
+// Sequence index, a sidecar file that lets Read skip checking which files exist and probing them. It's
+// only trusted while the modification time of the directory the files are in is unchanged, which is the
+// case as long as no file is added, removed or renamed. The index is rewritten in place so that it can be
+// kept in that directory without invalidating itself. Text format: a version line, a line with the pattern
+// and every option that affects the output format, the directory modification time, the number of frames,
+// one line per frame with the file number, size, dimensions and format and finally an end marker, which tells
+// a complete index apart from one that's still being written. Blank frames have the number -1.
+
+struct ReadIndexEntry {
+    int number;
+    uint64_t size;
+    int width;
+    int height;
+    int colorFamily;
+    int sampleType;
+    int depth;
+};
+
+static const char readIndexVersion[] = "imwri-index 2";
+
+static std::string readIndexKey(const ReadData *d) {
+    return d->filenames[0] + "\t" + std::to_string(d->firstNum) + "\t" + std::to_string(d->floatOutput) + "\t" + d->extract + "\t" +
+        std::to_string(d->scale) + "\t" + std::to_string(d->maxSize) + "\t" + std::to_string(d->nativeJPEG) + std::to_string(d->nativeEXR) + "\t" +
+        std::to_string(d->step) + "\t" + std::to_string(d->gaps) + "\t" + std::to_string(d->subimage) + "\t" + d->layer;
+}
+
+static bool loadReadIndex(const std::string &indexName, const std::string &key, int64_t dirMtime, std::vector<ReadIndexEntry> &entries) {
+    FILE *f = openFile(indexName, "rb");
+    if (!f)
+        return false;
+
+    std::string line;
+    auto readLine = [&]() {
+        line.clear();
+        int c;
+        while ((c = fgetc(f)) != EOF && c != '\n')
+            line += static_cast<char>(c);
+        return c != EOF || !line.empty();
+    };
+
+    bool valid = readLine() && line == readIndexVersion && readLine() && line == key;
+    int64_t mtime = 0;
+    int frames = 0;
+    valid = valid && readLine() && sscanf(line.c_str(), "%" SCNd64, &mtime) == 1 && mtime == dirMtime;
+    valid = valid && readLine() && sscanf(line.c_str(), "%d", &frames) == 1 && frames > 0;
+    if (valid) {
+        entries.resize(frames);
+        for (auto &e : entries) {
+            if (!readLine() || sscanf(line.c_str(), "%d %" SCNu64 " %d %d %d %d %d", &e.number, &e.size, &e.width, &e.height, &e.colorFamily, &e.sampleType, &e.depth) != 7) {
+                valid = false;
+                break;
+            }
+        }
+    }
+
+    valid = valid && readLine() && line == "end";
+    fclose(f);
+    if (!valid)
+        entries.clear();
+    return valid;
+}
+
+static bool saveReadIndex(const std::string &indexName, const std::string &key, int64_t dirMtime, const std::vector<ReadIndexEntry> &entries) {
+    std::string text = std::string(readIndexVersion) + "\n" + key + "\n" + std::to_string(dirMtime) + "\n" + std::to_string(entries.size()) + "\n";
+    for (const auto &e : entries) {
+        char line[128];
+        snprintf(line, sizeof(line), "%d %" PRIu64 " %d %d %d %d %d\n", e.number, e.size, e.width, e.height, e.colorFamily, e.sampleType, e.depth);
+        text += line;
+    }
+    text += "end\n";
+    return writeFile(indexName, text.data(), text.size(), false);
+}
+
+// Lists the file number of every frame for the gap modes that need it, the sequence starts at the first existing file
+static void fillSequenceGaps(ReadData *d, const std::vector<int> &numbers) {
+    if (d->gaps == ReadData::gmSkip) {
+        d->fileNumbers = numbers;
+        return;
+    }
+    int64_t frames = (static_cast<int64_t>(numbers.back()) - numbers.front()) / d->step + 1;
+    d->fileNumbers.resize(static_cast<size_t>(frames));
+    size_t next = 0;
+    for (int64_t i = 0; i < frames; i++) {
+        int number = static_cast<int>(numbers.front() + i * d->step);
+        if (number == numbers[next]) {
+            d->fileNumbers[i] = number;
+            next++;
+        } else {
+            d->fileNumbers[i] = d->gaps == ReadData::gmRepeat ? numbers[next - 1] : -1;
+        }
+    }
+}
+
+// Blank frames have the format of the first file and are black, the alpha is zero too
+static const VSFrame *createBlankFrame(const ReadData *d, VSCore *core, const VSAPI *vsapi) {
+    auto clear = [vsapi](VSFrame *f) {
+        for (int plane = 0; plane < vsapi->getVideoFrameFormat(f)->numPlanes; plane++)
+            memset(vsapi->getWritePtr(f, plane), 0, vsapi->getStride(f, plane) * vsapi->getFrameHeight(f, plane));
+    };
+    VSFrame *frame = vsapi->newVideoFrame(&d->blankFormat, d->blankWidth, d->blankHeight, nullptr, core);
+    clear(frame);
+    if (d->alpha) {
+        VSVideoFormat aformat;
+        vsapi->queryVideoFormat(&aformat, cfGray, d->blankFormat.sampleType, d->blankFormat.bitsPerSample, 0, 0, core);
+        VSFrame *alphaFrame = vsapi->newVideoFrame(&aformat, d->blankWidth, d->blankHeight, nullptr, core);
+        clear(alphaFrame);
+        vsapi->mapConsumeFrame(vsapi->getFramePropertiesRW(frame), "_Alpha", alphaFrame, maAppend);
+    }
+    return frame;
+}
+
+#if defined(IMWRI_HAS_TURBOJPEG) || defined(IMWRI_HAS_OPENEXR)
+// Fills in the format for files the native decoders handle from the start of the file, false if the header
+// isn't complete or the file is left to ImageMagick
+static bool probeNativeFile(const ReadData *d, const std::vector<unsigned char> &buffer, ReadIndexEntry &entry) {
+#if defined(IMWRI_HAS_TURBOJPEG)
+    JPEGInfo jpeg;
+    if (d->nativeJPEG && readJPEGInfo(buffer.data(), buffer.size(), jpeg)) {
+        entry.width = jpeg.width;
+        entry.height = jpeg.height;
+        entry.colorFamily = jpeg.gray ? cfGray : cfRGB;
+        entry.sampleType = stInteger;
+        entry.depth = 8;
+        return true;
+    }
+#endif
+#if defined(IMWRI_HAS_OPENEXR)
+    EXRInfo exr;
+    if (d->nativeEXR && readEXRInfo(buffer.data(), buffer.size(), exr, d->subimage, d->layer)) {
+        entry.width = exr.width;
+        entry.height = exr.height;
+        entry.colorFamily = exr.gray ? cfGray : cfRGB;
+        entry.sampleType = stFloat;
+        entry.depth = exr.half && !d->floatOutput ? 16 : 32;
+        return true;
+    }
+#endif
+    return false;
+}
+#endif
+
+// Determines what readGetFrame will return for the file without decoding it. Only the headers are read, files
+// for the native decoders are read up to a size that usually holds them and in full only if it didn't.
+static void probeReadFile(const ReadData *d, const std::string &filename, ReadIndexEntry &entry) {
+    int64_t mtime;
+    if (!getFileSizeAndTime(filename, entry.size, mtime))
+        throw Magick::ErrorFileOpen("Failed to read " + filename + ": " + strerror(errno));
+#if defined(IMWRI_HAS_TURBOJPEG) || defined(IMWRI_HAS_OPENEXR)
+    if (d->nativeJPEG || d->nativeEXR) {
+        static thread_local std::vector<unsigned char> buffer;
+        size_t length = static_cast<size_t>(std::min<uint64_t>(entry.size, 1 << 16));
+        if (!readFileHeader(filename, buffer, length))
+            throw Magick::ErrorFileOpen("Failed to read " + filename + ": " + strerror(errno));
+        if (isNativeFile(d, buffer.data(), buffer.size())) {
+            if (probeNativeFile(d, buffer, entry))
+                return;
+            if (buffer.size() < entry.size) {
+                if (!readFile(filename, buffer))
+                    throw Magick::ErrorFileOpen("Failed to read " + filename + ": " + strerror(errno));
+                if (probeNativeFile(d, buffer, entry))
+                    return;
+            }
+        }
+    }
+#endif
+    DecodeOptions options;
+    options.ping = true;
+    options.subimage = readSubimage(d, filename);
+    Magick::Image image = readImage(nullptr, 0, filename, options);
+    VSSampleType st;
+    readSampleTypeDepth(d->floatOutput, image, st, entry.depth);
+    entry.sampleType = st;
+    entry.colorFamily = readColorFamily(image);
+    int width = static_cast<int>(image.columns());
+    int height = static_cast<int>(image.rows());
+    if (!d->extract.empty()) {
+        width = std::min(d->cropWidth ? d->cropWidth : INT_MAX, width - d->cropLeft);
+        height = std::min(d->cropHeight ? d->cropHeight : INT_MAX, height - d->cropTop);
+    } else if (d->scale > 1 || d->maxSize) {
+        scaledSize(width, height, d->scale, d->maxSize, width, height);
+    }
+    entry.width = width;
+    entry.height = height;
+}
+
+// Probes every file of the sequence in parallel on the number of threads set with SetResources, nothing else is
+// happening while a filter is created
+static void buildReadIndex(const ReadData *d, std::vector<ReadIndexEntry> &entries, int threads) {
+    entries.assign(d->vi[0].numFrames, ReadIndexEntry());
+    for (int n = 0; n < d->vi[0].numFrames; n++)
+        entries[n].number = readFileNumber(d, n);
+    std::mutex errorMutex;
+    std::string error;
+    ThreadPool pool(threads - 1);
+    parallelFor(&pool, d->vi[0].numFrames, threads, [&](int n) {
+        // blank frames have nothing to probe and repeated files are copied below
+        if (entries[n].number < 0 || (n > 0 && entries[n].number == entries[n - 1].number))
+            return;
+        try {
+            probeReadFile(d, readFilename(d, n), entries[n]);
+        } catch (Magick::Exception &e) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (error.empty())
+                error = e.what();
+        }
+    });
+    if (!error.empty())
+        throw Magick::ErrorFileOpen(error);
+    for (int n = 1; n < d->vi[0].numFrames; n++)
+        if (entries[n].number >= 0 && entries[n].number == entries[n - 1].number)
+            entries[n] = entries[n - 1];
+}
+
 static const VSFrame *VS_CC readGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     ReadData *d = static_cast<ReadData *>(instanceData);
 
     if (activationReason == arInitial) {
         VSFrame *frame = nullptr;
         VSFrame *alphaFrame = nullptr;
-        
+
+        int number = readFileNumber(d, n);
+        if (number < 0) {
+            if (!d->blankFrame)
+                d->blankFrame = createBlankFrame(d, core, vsapi);
+            return vsapi->addFrameRef(d->blankFrame);
+        }
+        if (d->cachedFrame && number == d->cachedFrameNum)
+            return vsapi->addFrameRef(d->cachedFrame);
+
         try {
-            std::string filename = d->fileListMode ? d->filenames[n] : specialPrintf(d->filenames[0], n + d->firstNum);
+            std::string filename = readFilename(d, n);
             if (!isAbsolute(filename))
                 filename = d->workingDir + filename;
 
-            Magick::Image image(filename);
-            VSColorFamily cf = cfRGB;
-            if (image.colorSpace() == Magick::GRAYColorspace)
-                cf = cfGray;
-
-            int width = static_cast<int>(image.columns());
-            int height = static_cast<int>(image.rows());
-            size_t channels = image.channels();
-
+            FrameTimings timings;
+            timings.frame = n;
+            PhaseTimer readTimer(timings, phReadFile);
+            loadNativeFile(d, filename);
+            readTimer.setBytes(d->fileBuffer.size());
+            readTimer.stop();
+
+            Magick::Image image;
+            VSColorFamily cf;
+            int width;
+            int height;
             VSSampleType st;
             int depth;
-            readSampleTypeDepth(d, image, st, depth);
 
-            if (d->vi[0].format.colorFamily != cfUndefined && (cf != d->vi[0].format.colorFamily || depth != d->vi[0].format.bitsPerSample)) {
+#if defined(IMWRI_HAS_TURBOJPEG)
+            JPEGInfo jpeg;
+            bool nativeJPEG = d->nativeJPEG && readJPEGInfo(d->fileBuffer.data(), d->fileBuffer.size(), jpeg);
+#endif
+#if defined(IMWRI_HAS_OPENEXR)
+            EXRInfo exr;
+            bool nativeEXR = d->nativeEXR && readEXRInfo(d->fileBuffer.data(), d->fileBuffer.size(), exr, d->subimage, d->layer);
+#endif
+
+#if defined(IMWRI_HAS_TURBOJPEG)
+            if (nativeJPEG) {
+                cf = jpeg.gray ? cfGray : cfRGB;
+                width = jpeg.width;
+                height = jpeg.height;
+                st = stInteger;
+                depth = 8;
+            } else
+#endif
+#if defined(IMWRI_HAS_OPENEXR)
+            if (nativeEXR) {
+                cf = exr.gray ? cfGray : cfRGB;
+                width = exr.width;
+                height = exr.height;
+                st = stFloat;
+                depth = exr.half && !d->floatOutput ? 16 : 32;
+            } else
+#endif
+            {
+                // ImageMagick reads the file as part of decoding it
+                PhaseTimer decodeTimer(timings, phDecode);
+                uint64_t size;
+                int64_t mtime;
+                if (getFileSizeAndTime(filename, size, mtime))
+                    decodeTimer.setBytes(static_cast<int64_t>(size));
+                image = decodeReadImage(d, filename);
+                decodeTimer.stop();
+
+                cf = readColorFamily(image);
+                width = static_cast<int>(image.columns());
+                height = static_cast<int>(image.rows());
+                readSampleTypeDepth(d->floatOutput, image, st, depth);
+            }
+
+            if ((d->cropWidth && width != d->cropWidth) || (d->cropHeight && height != d->cropHeight)) {
+                vsapi->setFilterError(("Read: Crop region is outside of frame " + std::to_string(n)).c_str(), frameCtx);
+                return nullptr;
+            }
+
+            if (d->vi[0].format.colorFamily != cfUndefined && (cf != d->vi[0].format.colorFamily || st != d->vi[0].format.sampleType || depth != d->vi[0].format.bitsPerSample)) {
                 VSVideoFormat tmp;
                 vsapi->queryVideoFormat(&tmp, cf, st, depth, 0, 0, core);
 
@@ -1061,78 +3420,27 @@ static const VSFrame *VS_CC readGetFrame(int n, int activationReason, void *inst
                 alphaFrame = vsapi->newVideoFrame(&aformat, width, height, nullptr, core);
             }
 
-            const VSVideoFormat *fi = vsapi->getVideoFrameFormat(frame);
- 
-            bool isGray = fi->colorFamily == cfGray;                
-     
-            if (fi->bytesPerSample == 4 && fi->sampleType == stFloat) {
-                const Quantum scaleFactor = QuantumRange;
-                Magick::Pixels pixelCache(image);
-
-                float *r = reinterpret_cast<float *>(vsapi->getWritePtr(frame, 0));
-                float *g = reinterpret_cast<float *>(vsapi->getWritePtr(frame, isGray ? 0 : 1));
-                float *b = reinterpret_cast<float *>(vsapi->getWritePtr(frame, isGray ? 0 : 2));
-
-                ptrdiff_t strideR = vsapi->getStride(frame, 0);
-                ptrdiff_t strideG = vsapi->getStride(frame, isGray ? 0 : 1);
-                ptrdiff_t strideB = vsapi->getStride(frame, isGray ? 0 : 2);
-
-                ssize_t rOff = pixelCache.offset(MagickCore::RedPixelChannel);
-                ssize_t gOff = pixelCache.offset(MagickCore::GreenPixelChannel);
-                ssize_t bOff = pixelCache.offset(MagickCore::BluePixelChannel);
-
-                if (alphaFrame) {
-                    float *a = reinterpret_cast<float *>(vsapi->getWritePtr(alphaFrame, 0));
-                    ptrdiff_t strideA = vsapi->getStride(alphaFrame, 0);
-                    ssize_t aOff = pixelCache.offset(MagickCore::AlphaPixelChannel);
-
-                    if (aOff >= 0) {
-                        for (int y = 0; y < height; y++) {
-                            const MagickCore::Quantum* pixels = pixelCache.getConst(0, y, width, 1);
-                            for (int x = 0; x < width; x++) {
-                                r[x] = pixels[x * channels + rOff] / scaleFactor;
-                                g[x] = pixels[x * channels + gOff] / scaleFactor;
-                                b[x] = pixels[x * channels + bOff] / scaleFactor;
-                                a[x] = pixels[x * channels + aOff] / scaleFactor;
-                            }
-
-                            r += strideR / sizeof(float);
-                            g += strideG / sizeof(float);
-                            b += strideB / sizeof(float);
-                            a += strideA / sizeof(float);
-                        }
-                    } else {
-                        memset(a, 0, strideA  * height);
-                    }
-                } else {
-                    for (int y = 0; y < height; y++) {
-                        const MagickCore::Quantum* pixels = pixelCache.getConst(0, y, width, 1);
-                        for (int x = 0; x < width; x++) {
-                            r[x] = pixels[x * channels + rOff] / scaleFactor;
-                            g[x] = pixels[x * channels + gOff] / scaleFactor;
-                            b[x] = pixels[x * channels + bOff] / scaleFactor;
-                        }
-
-                        r += strideR / sizeof(float);
-                        g += strideG / sizeof(float);
-                        b += strideB / sizeof(float);
-                    }
-                }
-            } else if (fi->bytesPerSample == 4) {
-                readImageHelper<uint32_t>(frame, alphaFrame, isGray, image, width, height, fi->bitsPerSample, vsapi);
-            } else if (fi->bytesPerSample == 2) {
-                readImageHelper<uint16_t>(frame, alphaFrame, isGray, image, width, height, fi->bitsPerSample, vsapi);
-            } else if (fi->bytesPerSample == 1) {
-                readImageHelper<uint8_t>(frame, alphaFrame, isGray, image, width, height, fi->bitsPerSample, vsapi);
-            }
-#if defined(IMWRI_HAS_LCMS2)
-            if (d->embedICC) {
-                const MagickCore::StringInfo *icc_profile = MagickCore::GetImageProfile(image.constImage(), "icc");
-                if (icc_profile) {
-                    vsapi->mapSetData(vsapi->getFramePropertiesRW(frame), "ICCProfile", reinterpret_cast<const char *>(icc_profile->datum), icc_profile->length, dtBinary, maReplace);
-                }
-            }
+#if defined(IMWRI_HAS_TURBOJPEG)
+            if (nativeJPEG) {
+                PhaseTimer decodeTimer(timings, phDecode);
+                decodeTimer.setBytes(d->fileBuffer.size());
+                decodeJPEG(d->fileBuffer.data(), d->fileBuffer.size(), jpeg, frame, alphaFrame, vsapi);
+            } else
 #endif
+#if defined(IMWRI_HAS_OPENEXR)
+            if (nativeEXR) {
+                PhaseTimer decodeTimer(timings, phDecode);
+                decodeTimer.setBytes(d->fileBuffer.size());
+                decodeEXR(d->fileBuffer.data(), d->fileBuffer.size(), exr, frame, alphaFrame, getImageThreads(core, vsapi), vsapi);
+            } else
+#endif
+            {
+                PhaseTimer convertTimer(timings, phReadConvert);
+                imageToFrame(image, frame, alphaFrame, d->embedICC, vsapi);
+            }
+
+            if (d->timing)
+                setTimingProps(vsapi->getFramePropertiesRW(frame), timings, vsapi);
         } catch (Magick::Exception &e) {
             vsapi->setFilterError((std::string("Read: ImageMagick error: ") + e.what()).c_str(), frameCtx);
             vsapi->freeFrame(frame);
@@ -1142,6 +3450,11 @@ static const VSFrame *VS_CC readGetFrame(int n, int activationReason, void *inst
 
         if (alphaFrame)
             vsapi->mapConsumeFrame(vsapi->getFramePropertiesRW(frame), "_Alpha", alphaFrame, maAppend);
+        if (d->gaps == ReadData::gmRepeat) {
+            vsapi->freeFrame(d->cachedFrame);
+            d->cachedFrame = vsapi->addFrameRef(frame);
+            d->cachedFrameNum = number;
+        }
         return frame;
     }
 
@@ -1150,6 +3463,8 @@ static const VSFrame *VS_CC readGetFrame(int n, int activationReason, void *inst
 
 static void VS_CC readFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     ReadData *d = static_cast<ReadData *>(instanceData);
+    vsapi->freeFrame(d->cachedFrame);
+    vsapi->freeFrame(d->blankFrame);
     delete d;
 }
 
@@ -1168,10 +3483,71 @@ static void VS_CC readCreate(const VSMap *in, VSMap *out, void *userData, VSCore
     d->alpha = !!vsapi->mapGetInt(in, "alpha", 0, &err);
     d->mismatch = !!vsapi->mapGetInt(in, "mismatch", 0, &err);
     d->floatOutput = !!vsapi->mapGetInt(in, "float_output", 0, &err);
+    d->timing = !!vsapi->mapGetInt(in, "timing", 0, &err);
+    d->cropLeft = vsapi->mapGetIntSaturated(in, "left", 0, &err);
+    d->cropTop = vsapi->mapGetIntSaturated(in, "top", 0, &err);
+    d->cropWidth = vsapi->mapGetIntSaturated(in, "width", 0, &err);
+    if (err)
+        d->cropWidth = 0;
+    else if (d->cropWidth < 1) {
+        vsapi->mapSetError(out, "Read: Crop width must be at least 1");
+        return;
+    }
+    d->cropHeight = vsapi->mapGetIntSaturated(in, "height", 0, &err);
+    if (err)
+        d->cropHeight = 0;
+    else if (d->cropHeight < 1) {
+        vsapi->mapSetError(out, "Read: Crop height must be at least 1");
+        return;
+    }
+    if (d->cropLeft < 0 || d->cropTop < 0) {
+        vsapi->mapSetError(out, "Read: Crop offsets can't be negative");
+        return;
+    }
+    d->scale = vsapi->mapGetIntSaturated(in, "scale", 0, &err);
+    if (err)
+        d->scale = 1;
+    else if (d->scale < 1) {
+        vsapi->mapSetError(out, "Read: Scale must be at least 1");
+        return;
+    }
+    d->maxSize = vsapi->mapGetIntSaturated(in, "max_size", 0, &err);
+    if (d->maxSize < 0) {
+        vsapi->mapSetError(out, "Read: Maximum size can't be negative");
+        return;
+    }
+    bool crop = d->cropLeft || d->cropTop || d->cropWidth || d->cropHeight;
+    if (crop && (d->scale > 1 || d->maxSize)) {
+        vsapi->mapSetError(out, "Read: Cropping and scaling can't be combined");
+        return;
+    }
+    if (crop)
+        d->extract = std::to_string(d->cropWidth ? d->cropWidth : INT_MAX) + "x" + std::to_string(d->cropHeight ? d->cropHeight : INT_MAX) + "+" + std::to_string(d->cropLeft) + "+" + std::to_string(d->cropTop);
+    d->subimage = vsapi->mapGetIntSaturated(in, "subimage", 0, &err);
+    if (err)
+        d->subimage = -1;
+    else if (d->subimage < 0) {
+        vsapi->mapSetError(out, "Read: Subimage can't be negative");
+        return;
+    }
+    const char *layer = vsapi->mapGetData(in, "layer", 0, &err);
+    if (!err)
+        d->layer = layer;
 #if defined(IMWRI_HAS_LCMS2)
     d->embedICC = !!vsapi->mapGetInt(in, "embed_icc", 0, &err);
 #else
     d->embedICC = false;
+#endif
+#if defined(IMWRI_HAS_TURBOJPEG)
+    // JPEG files only have a single image
+    d->nativeJPEG = !crop && d->scale == 1 && !d->maxSize && !d->floatOutput && !d->embedICC && d->subimage <= 0 && d->layer.empty();
+#else
+    d->nativeJPEG = false;
+#endif
+#if defined(IMWRI_HAS_OPENEXR)
+    d->nativeEXR = !crop && d->scale == 1 && !d->maxSize;
+#else
+    d->nativeEXR = false;
 #endif
     int numElem = vsapi->mapNumElements(in, "filename");
     d->filenames.resize(numElem);
@@ -1179,15 +3555,95 @@ static void VS_CC readCreate(const VSMap *in, VSMap *out, void *userData, VSCore
         d->filenames[i] = vsapi->mapGetData(in, "filename", i, nullptr);
     
     d->vi[0] = {{}, 30, 1, 0, 0, static_cast<int>(d->filenames.size())};
+    bool isPattern = d->vi[0].numFrames == 1 && specialPrintf(d->filenames[0], 0) != d->filenames[0];
+
+    d->step = vsapi->mapGetIntSaturated(in, "step", 0, &err);
+    bool hasStep = !err;
+    if (!hasStep)
+        d->step = 1;
+    else if (d->step < 1) {
+        vsapi->mapSetError(out, "Read: Step must be at least 1");
+        return;
+    }
+    const char *gaps = vsapi->mapGetData(in, "gaps", 0, &err);
+    bool hasGaps = !err;
+    if (!hasGaps || !strcmp(gaps, "stop")) {
+        d->gaps = ReadData::gmStop;
+    } else if (!strcmp(gaps, "skip")) {
+        d->gaps = ReadData::gmSkip;
+    } else if (!strcmp(gaps, "repeat")) {
+        d->gaps = ReadData::gmRepeat;
+    } else if (!strcmp(gaps, "blank")) {
+        d->gaps = ReadData::gmBlank;
+    } else {
+        vsapi->mapSetError(out, "Read: Gaps must be stop, skip, repeat or blank");
+        return;
+    }
+    if ((hasStep || hasGaps) && !isPattern) {
+        vsapi->mapSetError(out, "Read: Step and gaps can only be used with a filename pattern");
+        return;
+    }
+    // gaps are found by listing a single directory
+    std::string patternDir = patternDirectory(d->filenames[0]);
+    if (d->gaps != ReadData::gmStop && specialPrintf(patternDir, 0) != patternDir) {
+        vsapi->mapSetError(out, "Read: Gaps can only be used with a filename pattern that has the number in the file name");
+        return;
+    }
+
+    std::string indexName;
+    std::string indexKey;
+    int64_t dirMtime = 0;
+    std::vector<ReadIndexEntry> index;
+    const char *indexArg = vsapi->mapGetData(in, "index", 0, &err);
+    if (!err) {
+        const std::string &dir = patternDir;
+        if (!isPattern || specialPrintf(dir, 0) != dir) {
+            vsapi->mapSetError(out, "Read: An index can only be used with a filename pattern that has the number in the file name");
+            return;
+        }
+        if (!getModificationTime(dir, dirMtime)) {
+            vsapi->mapSetError(out, ("Read: Failed to read the modification time of " + dir + ": " + strerror(errno)).c_str());
+            return;
+        }
+        indexName = indexArg;
+        indexKey = readIndexKey(d.get());
+        if (loadReadIndex(indexName, indexKey, dirMtime, index)) {
+            d->fileListMode = false;
+            d->vi[0].numFrames = static_cast<int>(index.size());
+            if (d->gaps != ReadData::gmStop)
+                for (const auto &e : index)
+                    d->fileNumbers.push_back(e.number);
+        } else if (!fileExists(indexName)) {
+            // creating the index could change the directory's modification time so it's done before that's recorded
+            FILE *f = openFile(indexName, "ab");
+            if (f)
+                fclose(f);
+            getModificationTime(dir, dirMtime);
+        }
+    }
+
     // See if it's a single filename with number substitution and check how many files exist
-    if (d->vi[0].numFrames == 1 && specialPrintf(d->filenames[0], 0) != d->filenames[0]) {
+    if (isPattern && index.empty()) {
         d->fileListMode = false;
 
-        for (int i = d->firstNum; i < INT_MAX; i++) {
-            if (!fileExists(specialPrintf(d->filenames[0], i))) {
-                d->vi[0].numFrames = i - d->firstNum;
-                break;
+        if (d->gaps == ReadData::gmStop) {
+            d->vi[0].numFrames = 0;
+            for (int64_t i = d->firstNum; i <= INT_MAX && fileExists(specialPrintf(d->filenames[0], static_cast<int>(i))); i += d->step)
+                d->vi[0].numFrames++;
+        } else {
+            std::vector<int> numbers;
+            if (!scanSequence(d->filenames[0], d->firstNum, d->step, numbers)) {
+                vsapi->mapSetError(out, ("Read: Failed to list " + patternDir + ": " + strerror(errno)).c_str());
+                return;
+            }
+            if (!numbers.empty()) {
+                fillSequenceGaps(d.get(), numbers);
+                if (d->fileNumbers.size() > INT_MAX) {
+                    vsapi->mapSetError(out, "Read: The sequence has too many frames");
+                    return;
+                }
             }
+            d->vi[0].numFrames = static_cast<int>(d->fileNumbers.size());
         }
 
         if (d->vi[0].numFrames == 0) {
@@ -1197,19 +3653,70 @@ static void VS_CC readCreate(const VSMap *in, VSMap *out, void *userData, VSCore
     }
 
     try {
-        Magick::Image image(d->fileListMode ? d->filenames[0] : specialPrintf(d->filenames[0], d->firstNum));
-
+        VSColorFamily cf;
+        int width;
+        int height;
         VSSampleType st;
         int depth;
-        readSampleTypeDepth(d.get(), image, st, depth);
+        bool constantFormat = !d->mismatch || d->vi[0].numFrames == 1;
+
+        if (!indexName.empty()) {
+            if (index.empty()) {
+                buildReadIndex(d.get(), index, getImageThreads(core, vsapi));
+                if (!saveReadIndex(indexName, indexKey, dirMtime, index))
+                    vsapi->logMessage(mtWarning, ("Read: Failed to write index " + indexName + ": " + strerror(errno)).c_str(), core);
+            }
+
+            cf = static_cast<VSColorFamily>(index[0].colorFamily);
+            width = index[0].width;
+            height = index[0].height;
+            st = static_cast<VSSampleType>(index[0].sampleType);
+            depth = index[0].depth;
+
+            // with mismatch set the per-frame properties show whether the clip can have a constant format anyway
+            if (d->mismatch) {
+                bool uniform = true;
+                for (const auto &e : index)
+                    if (e.number >= 0)
+                        uniform = uniform && e.width == width && e.height == height && e.colorFamily == cf && e.sampleType == st && e.depth == depth;
+                constantFormat = uniform;
+            }
+        } else {
+            std::string filename = readFilename(d.get(), 0);
+            loadNativeFile(d.get(), filename);
+
+#if defined(IMWRI_HAS_OPENEXR)
+            // the format has to match what readGetFrame returns so half float files are probed the same way
+            EXRInfo exr;
+            if (d->nativeEXR && readEXRInfo(d->fileBuffer.data(), d->fileBuffer.size(), exr, d->subimage, d->layer)) {
+                cf = exr.gray ? cfGray : cfRGB;
+                width = exr.width;
+                height = exr.height;
+                st = stFloat;
+                depth = exr.half && !d->floatOutput ? 16 : 32;
+            } else
+#endif
+            {
+                Magick::Image image = decodeReadImage(d.get(), filename);
+                cf = readColorFamily(image);
+                width = static_cast<int>(image.columns());
+                height = static_cast<int>(image.rows());
+                readSampleTypeDepth(d->floatOutput, image, st, depth);
+            }
+        }
+
+        if (width < 1 || height < 1 || (d->cropWidth && width != d->cropWidth) || (d->cropHeight && height != d->cropHeight)) {
+            vsapi->mapSetError(out, "Read: Crop region is outside of the image");
+            return;
+        }
 
-        if (!d->mismatch || d->vi[0].numFrames == 1) {
-            d->vi[0].height = static_cast<int>(image.rows());
-            d->vi[0].width = static_cast<int>(image.columns());
-            VSColorFamily cf = cfRGB;
-            if (image.colorSpace() == Magick::GRAYColorspace)
-                cf = cfGray;
+        vsapi->queryVideoFormat(&d->blankFormat, cf, st, depth, 0, 0, core);
+        d->blankWidth = width;
+        d->blankHeight = height;
 
+        if (constantFormat) {
+            d->vi[0].height = height;
+            d->vi[0].width = width;
             vsapi->queryVideoFormat(&d->vi[0].format, cf, st, depth, 0, 0, core);
         }
 
@@ -1229,13 +3736,125 @@ static void VS_CC readCreate(const VSMap *in, VSMap *out, void *userData, VSCore
     d.release();
 }
 
+static void VS_CC decodeFrame(const VSMap *in, VSMap *out, void *, VSCore *core, const VSAPI *vsapi) {
+    int err = 0;
+
+    initMagick(core, vsapi);
+
+    const char *data = vsapi->mapGetData(in, "bytes", 0, nullptr);
+    int length = vsapi->mapGetDataSize(in, "bytes", 0, nullptr);
+
+    std::string hint;
+    const char *imgFormat = vsapi->mapGetData(in, "imgformat", 0, &err);
+    if (!err && *imgFormat)
+        hint = std::string(imgFormat) + ":";
+
+    bool alpha = !!vsapi->mapGetInt(in, "alpha", 0, &err);
+    bool floatOutput = !!vsapi->mapGetInt(in, "float_output", 0, &err);
+#if defined(IMWRI_HAS_LCMS2)
+    bool embedICC = !!vsapi->mapGetInt(in, "embed_icc", 0, &err);
+#else
+    bool embedICC = false;
+#endif
+
+    VSFrame *frame = nullptr;
+    VSFrame *alphaFrame = nullptr;
+
+    FrameTimings timings;
+    try {
+        PhaseTimer decodeTimer(timings, phDecode);
+        decodeTimer.setBytes(length);
+        Magick::Image image = readImage(data, length, hint);
+        decodeTimer.stop();
+
+        int width = static_cast<int>(image.columns());
+        int height = static_cast<int>(image.rows());
+
+        VSSampleType st;
+        int depth;
+        readSampleTypeDepth(floatOutput, image, st, depth);
+
+        VSVideoFormat fformat;
+        vsapi->queryVideoFormat(&fformat, readColorFamily(image), st, depth, 0, 0, core);
+        frame = vsapi->newVideoFrame(&fformat, width, height, nullptr, core);
+
+        if (alpha) {
+            VSVideoFormat aformat;
+            vsapi->queryVideoFormat(&aformat, cfGray, st, depth, 0, 0, core);
+            alphaFrame = vsapi->newVideoFrame(&aformat, width, height, nullptr, core);
+        }
+
+        PhaseTimer convertTimer(timings, phReadConvert);
+        imageToFrame(image, frame, alphaFrame, embedICC, vsapi);
+    } catch (Magick::Exception &e) {
+        vsapi->mapSetError(out, (std::string("DecodeFrame: ImageMagick error: ") + e.what()).c_str());
+        vsapi->freeFrame(frame);
+        vsapi->freeFrame(alphaFrame);
+        return;
+    }
+
+    if (alphaFrame)
+        vsapi->mapConsumeFrame(vsapi->getFramePropertiesRW(frame), "_Alpha", alphaFrame, maAppend);
+    vsapi->mapConsumeFrame(out, "frame", frame, maReplace);
+}
+
+
+//////////////////////////////////////////
+// Resources
+
+static void VS_CC setResources(const VSMap *in, VSMap *out, void *, VSCore *core, const VSAPI *vsapi) {
+    initMagick(core, vsapi);
+
+    static const struct {
+        const char *name;
+        void (*set)(const MagickCore::MagickSizeType);
+        MagickCore::MagickSizeType (*get)();
+        int64_t minimum;
+    } limits[] = {
+        { "threads", Magick::ResourceLimits::thread, Magick::ResourceLimits::thread, 1 },
+        { "memory", Magick::ResourceLimits::memory, Magick::ResourceLimits::memory, 0 },
+        { "map", Magick::ResourceLimits::map, Magick::ResourceLimits::map, 0 },
+        { "area", Magick::ResourceLimits::area, Magick::ResourceLimits::area, 0 },
+        { "disk", Magick::ResourceLimits::disk, Magick::ResourceLimits::disk, 0 },
+    };
+
+    for (const auto &limit : limits) {
+        int err = 0;
+        int64_t value = vsapi->mapGetInt(in, limit.name, 0, &err);
+        if (err)
+            continue;
+        if (value < limit.minimum) {
+            vsapi->mapSetError(out, (std::string("SetResources: Invalid ") + limit.name + " limit").c_str());
+            return;
+        }
+        limit.set(static_cast<MagickCore::MagickSizeType>(value));
+    }
+
+    // IMWRI's own encoders follow the same thread limit
+    int err = 0;
+    int threads = vsapi->mapGetIntSaturated(in, "threads", 0, &err);
+    if (!err)
+        imageThreads = threads;
+
+    for (const auto &limit : limits)
+        vsapi->mapSetInt(out, limit.name, static_cast<int64_t>(std::min<MagickCore::MagickSizeType>(limit.get(), INT64_MAX)), maReplace);
+}
 
 //////////////////////////////////////////
 // Init
 
 VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI *vspapi) {
     vspapi->configPlugin(IMWRI_ID, IMWRI_NAMESPACE, IMWRI_PLUGIN_NAME, VS_MAKE_VERSION(2, 0), VAPOURSYNTH_API_VERSION, 0, plugin);
-    vspapi->registerFunction("Write", "clip:vnode;imgformat:data;filename:data;firstnum:int:opt;quality:int:opt;dither:int:opt;compression_type:data:opt;overwrite:int:opt;alpha:vnode:opt;", "clip:vnode;", writeCreate, nullptr, plugin);
-    vspapi->registerFunction("Read", "filename:data[];firstnum:int:opt;mismatch:int:opt;alpha:int:opt;float_output:int:opt;embed_icc:int:opt;", "clip:vnode;", readCreate, nullptr, plugin);
-    vspapi->registerFunction("EncodeFrame", "frame:vframe;imgformat:data;quality:int:opt;dither:int:opt;compression_type:data:opt;alpha:vframe:opt;", "bytes:data;", encodeFrame, nullptr, plugin);
+    vspapi->registerFunction("Write", "clip:vnode;imgformat:data[];filename:data[]:opt;firstnum:int:opt;quality:int[]:opt;compression_level:int[]:opt;dither:int:opt;compression_type:data[]:opt;overwrite:int:opt;alpha:vnode:opt;fd:int:opt;sync:int:opt;manifest:data:opt;timing:int:opt;depth:int:opt;dither_type:data:opt;dedupe:int:opt;scale:int[]:opt;max_size:int[]:opt;layers:vnode[]:opt;layer_names:data[]:opt;", "clip:vnode;", writeCreate, nullptr, plugin);
+    vspapi->registerFunction("Read", "filename:data[];firstnum:int:opt;mismatch:int:opt;alpha:int:opt;float_output:int:opt;embed_icc:int:opt;timing:int:opt;left:int:opt;top:int:opt;width:int:opt;height:int:opt;scale:int:opt;max_size:int:opt;index:data:opt;step:int:opt;gaps:data:opt;subimage:int:opt;layer:data:opt;", "clip:vnode;", readCreate, nullptr, plugin);
+    vspapi->registerFunction("EncodeFrame", "frame:vframe;imgformat:data[];quality:int[]:opt;compression_level:int[]:opt;dither:int:opt;compression_type:data[]:opt;alpha:vframe:opt;depth:int:opt;dither_type:data:opt;scale:int[]:opt;max_size:int[]:opt;", "bytes:data[];", encodeFrame, nullptr, plugin);
+    vspapi->registerFunction("DecodeFrame", "bytes:data;imgformat:data:opt;alpha:int:opt;float_output:int:opt;embed_icc:int:opt;", "frame:vframe;", decodeFrame, nullptr, plugin);
+    vspapi->registerFunction("Stats", "reset:int:opt;", "any", stats, nullptr, plugin);
+    vspapi->registerFunction("Trace", "filename:data:opt;", "", trace, nullptr, plugin);
+    vspapi->registerFunction("SetResources", "threads:int:opt;memory:int:opt;map:int:opt;area:int:opt;disk:int:opt;", "threads:int;memory:int;map:int;area:int;disk:int;", setResources, nullptr, plugin);
+
+    const char *traceEnv = getenv("IMWRI_TRACE");
+    std::string error;
+    if (traceEnv && *traceEnv && !tracing)
+        setTrace(traceEnv, error);
 }
@@ -0,0 +1,263 @@
+/*
+* Copyright (c) 2014-2019 Fredrik Mellbin
+*
+* This file is part of VapourSynth.
+*
+* VapourSynth is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* VapourSynth is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with VapourSynth; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+// IMWRI's own PNG encoder for 8 and 16 bit planes, which compresses pieces of the image in parallel with
+// zlib. Kept free of any VapourSynth API usage so it can also be checked by the benchmark.
+
+#ifndef IMWRI_PNGENCODER_H
+#define IMWRI_PNGENCODER_H
+
+#include "conversion.h"
+#include <zlib.h>
+#include <atomic>
+#include <cstdlib>
+
+static void writeBigEndian32(unsigned char *dst, uint32_t value) {
+    dst[0] = static_cast<unsigned char>(value >> 24);
+    dst[1] = static_cast<unsigned char>(value >> 16);
+    dst[2] = static_cast<unsigned char>(value >> 8);
+    dst[3] = static_cast<unsigned char>(value);
+}
+
+// Writes a chunk whose data is the concatenation of up to three pieces so the zlib header and checksum
+// don't have to be copied together with the compressed data
+template<typename Buffer>
+static void writePNGChunk(Buffer &buf, const char *type, const unsigned char *data, size_t length, const unsigned char *prefix = nullptr, size_t prefixLength = 0, const unsigned char *suffix = nullptr, size_t suffixLength = 0) {
+    unsigned char header[8];
+    writeBigEndian32(header, static_cast<uint32_t>(prefixLength + length + suffixLength));
+    memcpy(header + 4, type, 4);
+    buf.write(header, 8);
+    uLong crc = crc32(0, header + 4, 4);
+    if (prefixLength) {
+        buf.write(prefix, prefixLength);
+        crc = crc32(crc, prefix, static_cast<uInt>(prefixLength));
+    }
+    if (length) {
+        buf.write(data, length);
+        crc = crc32(crc, data, static_cast<uInt>(length));
+    }
+    if (suffixLength) {
+        buf.write(suffix, suffixLength);
+        crc = crc32(crc, suffix, static_cast<uInt>(suffixLength));
+    }
+    unsigned char trailer[4];
+    writeBigEndian32(trailer, static_cast<uint32_t>(crc));
+    buf.write(trailer, 4);
+}
+
+static inline unsigned char paethPredictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return static_cast<unsigned char>(a);
+    else if (pb <= pc)
+        return static_cast<unsigned char>(b);
+    return static_cast<unsigned char>(c);
+}
+
+// Applies PNG filter type 0-4 to a row, prev is all zeroes for the first row
+static void filterPNGRow(int type, const unsigned char *row, const unsigned char *prev, unsigned char *dst, size_t rowBytes, int bpp) {
+    for (size_t i = 0; i < rowBytes; i++) {
+        int a = i >= static_cast<size_t>(bpp) ? row[i - bpp] : 0;
+        int b = prev[i];
+        int c = i >= static_cast<size_t>(bpp) ? prev[i - bpp] : 0;
+        switch (type) {
+        case 0: dst[i] = row[i]; break;
+        case 1: dst[i] = static_cast<unsigned char>(row[i] - a); break;
+        case 2: dst[i] = static_cast<unsigned char>(row[i] - b); break;
+        case 3: dst[i] = static_cast<unsigned char>(row[i] - ((a + b) >> 1)); break;
+        default: dst[i] = static_cast<unsigned char>(row[i] - paethPredictor(a, b, c)); break;
+        }
+    }
+}
+
+// Runs func for every index from 0 to count - 1, possibly on several threads at once
+typedef std::function<void(int count, const std::function<void(int)> &func)> PNGParallelFor;
+
+// Encodes the planes as an 8 or 16 bit gray or RGB PNG, with alpha if src has an alpha plane, into buf which
+// needs clear() and write(data, size). The rows are split into chunks that are deflated in parallel the same
+// way pigz does it, every chunk but the last ends with a sync flush so the pieces join into a single zlib
+// stream, and each chunk is primed with the end of the previous one so little compression is lost. The
+// chunks are only made small when threads is above 1. Filter types 0-4 are used for every row, anything
+// above picks the best one per row like libpng does.
+template<typename Buffer>
+static void encodePNGPlanes(const ConstPlanes &src, int width, int height, int bytesPerSample, bool isGray, int level, int filter, int threads, const PNGParallelFor &parallelFor, Buffer &buf) {
+    // the worker threads have their own thread_local instances so these have to be accessed through references
+    static thread_local std::vector<unsigned char> filteredBuffer;
+    static thread_local std::vector<std::vector<unsigned char>> compressedBuffers;
+    std::vector<unsigned char> &filtered = filteredBuffer;
+    std::vector<std::vector<unsigned char>> &compressed = compressedBuffers;
+
+    const uint8_t *planes[4];
+    ptrdiff_t stride[4];
+    int channels = 0;
+    for (int plane = 0; plane < (isGray ? 1 : 3); plane++, channels++) {
+        planes[channels] = static_cast<const uint8_t *>(src.ptr[plane]);
+        stride[channels] = src.stride[plane];
+    }
+    bool hasAlpha = !!src.ptr[3];
+    if (hasAlpha) {
+        planes[channels] = static_cast<const uint8_t *>(src.ptr[3]);
+        stride[channels] = src.stride[3];
+        channels++;
+    }
+
+    int bpp = channels * bytesPerSample;
+    size_t rowBytes = static_cast<size_t>(width) * bpp;
+    size_t filteredStride = rowBytes + 1;
+    // chunks are kept large enough that the sync flushes cost next to nothing, a single thread uses the
+    // largest size that still keeps every IDAT chunk below the 2^31 byte limit
+    size_t chunkBytes = threads > 1 ? (1 << 18) : (1 << 28);
+    int rowsPerChunk = static_cast<int>(std::max<size_t>(1, chunkBytes / filteredStride));
+    int numChunks = (height + rowsPerChunk - 1) / rowsPerChunk;
+
+    filtered.resize(filteredStride * height);
+    compressed.resize(numChunks);
+    std::vector<uLong> adlers(numChunks);
+    std::atomic<bool> failed(false);
+
+    auto rawRow = [&](int y, unsigned char *dst) {
+        for (int c = 0; c < channels; c++) {
+            const uint8_t *row = planes[c] + y * stride[c];
+            if (bytesPerSample == 1) {
+                for (int x = 0; x < width; x++)
+                    dst[x * bpp + c] = row[x];
+            } else {
+                const uint16_t *row16 = reinterpret_cast<const uint16_t *>(row);
+                for (int x = 0; x < width; x++) {
+                    dst[x * bpp + c * 2] = static_cast<unsigned char>(row16[x] >> 8);
+                    dst[x * bpp + c * 2 + 1] = static_cast<unsigned char>(row16[x]);
+                }
+            }
+        }
+    };
+
+    parallelFor(numChunks, [&](int chunk) {
+        std::vector<unsigned char> rows(rowBytes * 2);
+        std::vector<unsigned char> candidate(filter > 4 ? rowBytes : 0);
+        unsigned char *prev = rows.data();
+        unsigned char *cur = rows.data() + rowBytes;
+        int start = chunk * rowsPerChunk;
+        int end = std::min(height, start + rowsPerChunk);
+        if (start > 0)
+            rawRow(start - 1, prev);
+        else
+            memset(prev, 0, rowBytes);
+
+        for (int y = start; y < end; y++) {
+            rawRow(y, cur);
+            unsigned char *dst = filtered.data() + y * filteredStride;
+            if (filter <= 4) {
+                dst[0] = static_cast<unsigned char>(filter);
+                filterPNGRow(filter, cur, prev, dst + 1, rowBytes, bpp);
+            } else {
+                // minimum sum of absolute differences heuristic
+                uint64_t bestCost = UINT64_MAX;
+                for (int type = 0; type <= 4; type++) {
+                    filterPNGRow(type, cur, prev, candidate.data(), rowBytes, bpp);
+                    uint64_t cost = 0;
+                    for (size_t i = 0; i < rowBytes; i++)
+                        cost += std::abs(static_cast<int>(static_cast<signed char>(candidate[i])));
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        dst[0] = static_cast<unsigned char>(type);
+                        memcpy(dst + 1, candidate.data(), rowBytes);
+                    }
+                }
+            }
+            std::swap(prev, cur);
+        }
+    });
+
+    parallelFor(numChunks, [&](int chunk) {
+        const unsigned char *in = filtered.data() + chunk * rowsPerChunk * filteredStride;
+        size_t length = std::min<size_t>(rowsPerChunk, height - chunk * rowsPerChunk) * filteredStride;
+        bool last = chunk == numChunks - 1;
+        adlers[chunk] = adler32(adler32(0, nullptr, 0), in, static_cast<uInt>(length));
+
+        z_stream strm = {};
+        if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, filter ? Z_FILTERED : Z_DEFAULT_STRATEGY) != Z_OK) {
+            failed = true;
+            return;
+        }
+        if (chunk > 0) {
+            size_t dictLength = std::min<size_t>(32768, chunk * rowsPerChunk * filteredStride);
+            deflateSetDictionary(&strm, in - dictLength, static_cast<uInt>(dictLength));
+        }
+
+        std::vector<unsigned char> &out = compressed[chunk];
+        out.resize(deflateBound(&strm, static_cast<uLong>(length)) + 16);
+        strm.next_in = const_cast<Bytef *>(in);
+        strm.avail_in = static_cast<uInt>(length);
+        strm.next_out = out.data();
+        strm.avail_out = static_cast<uInt>(out.size());
+        for (;;) {
+            int ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+            if (ret == Z_STREAM_ERROR) {
+                failed = true;
+                break;
+            }
+            if (last ? ret == Z_STREAM_END : (strm.avail_in == 0 && strm.avail_out != 0))
+                break;
+            size_t used = out.size() - strm.avail_out;
+            out.resize(out.size() * 2);
+            strm.next_out = out.data() + used;
+            strm.avail_out = static_cast<uInt>(out.size() - used);
+        }
+        out.resize(out.size() - strm.avail_out);
+        deflateEnd(&strm);
+    });
+
+    if (failed)
+        throw Magick::ErrorCoder("zlib: Failed to compress image");
+
+    buf.clear();
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    buf.write(signature, sizeof(signature));
+
+    unsigned char ihdr[13];
+    writeBigEndian32(ihdr, width);
+    writeBigEndian32(ihdr + 4, height);
+    ihdr[8] = static_cast<unsigned char>(bytesPerSample * 8);
+    ihdr[9] = static_cast<unsigned char>((isGray ? 0 : 2) | (hasAlpha ? 4 : 0));
+    ihdr[10] = 0;
+    ihdr[11] = 0;
+    ihdr[12] = 0;
+    writePNGChunk(buf, "IHDR", ihdr, sizeof(ihdr));
+
+    unsigned char zlibHeader[2] = { 0x78, static_cast<unsigned char>((level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6) };
+    zlibHeader[1] += static_cast<unsigned char>(31 - (zlibHeader[0] * 256 + zlibHeader[1]) % 31);
+    uLong adler = adlers[0];
+    for (int chunk = 1; chunk < numChunks; chunk++)
+        adler = adler32_combine(adler, adlers[chunk], static_cast<z_off_t>(std::min<size_t>(rowsPerChunk, height - chunk * rowsPerChunk) * filteredStride));
+    unsigned char zlibTrailer[4];
+    writeBigEndian32(zlibTrailer, static_cast<uint32_t>(adler));
+
+    for (int chunk = 0; chunk < numChunks; chunk++)
+        writePNGChunk(buf, "IDAT", compressed[chunk].data(), compressed[chunk].size(),
+            chunk == 0 ? zlibHeader : nullptr, chunk == 0 ? sizeof(zlibHeader) : 0,
+            chunk == numChunks - 1 ? zlibTrailer : nullptr, chunk == numChunks - 1 ? sizeof(zlibTrailer) : 0);
+
+    writePNGChunk(buf, "IEND", nullptr, 0);
+}
+
+#endif